@@ -0,0 +1,121 @@
+#include <const.h>
+#include <handler.h>
+#include <sort_kernel.h>
+#include <util.h>
+#include <string.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+// the sort service before the batch handler: copy into a VLA, std::sort
+static void legacySort(char* out, const char* in, uint32_t len) {
+  char data[len];
+  memcpy(data, in, len);
+  std::sort(data, data + sizeof(data));
+  memcpy(out, data, len);
+}
+
+template <typename F>
+static double bench(const std::vector<std::string>& inputs, int rounds, F&& sort_fn) {
+  char out[MESSAGE_BUF_SIZE];
+  uint64_t sink = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (int r = 0; r < rounds; r++) {
+    for (auto& in : inputs) {
+      sort_fn(out, in);
+      sink += out[0];
+    }
+  }
+  auto end = std::chrono::steady_clock::now();
+  if (sink == 1) {
+    info("unlikely");
+  }
+  return std::chrono::duration<double, std::nano>(end - start).count() / (rounds * inputs.size());
+}
+
+static void check(void (*kernel)(char*, uint32_t), const char* name) {
+  for (uint32_t len = 0; len <= MESSAGE_BUF_SIZE; len++) {
+    for (int t = 0; t < 100; t++) {
+      char a[MESSAGE_BUF_SIZE], b[MESSAGE_BUF_SIZE];
+      for (uint32_t i = 0; i < len; i++) {
+        a[i] = b[i] = static_cast<char>(rand() % (t % 2 ? 256 : 8));  // with and without many ties
+      }
+      kernel(a, len);
+      std::sort(b, b + len);
+      checkEqual(memcmp(a, b, len), 0, name);
+    }
+  }
+}
+
+int main(int argc, char *argv[]) {
+  int rounds = argc > 1 ? atoi(argv[1]) : 2000;
+  uint32_t len = argc > 2 ? atoi(argv[2]) : 0;  // 0: random length in [1, 64]
+
+  check(sortBytesScalar, "scalar kernel is wrong");
+#if defined(__x86_64__)
+  check(sortBytesSSE, "sse kernel is wrong");
+  if (hasAVX2()) {
+    check(sortBytesAVX2, "avx2 kernel is wrong");
+  }
+#endif
+
+  std::vector<std::string> inputs(1024);
+  for (auto& in : inputs) {
+    uint32_t n = len != 0 ? std::min(len, MESSAGE_BUF_SIZE) : 1 + rand() % MESSAGE_BUF_SIZE;
+    for (uint32_t i = 0; i < n; i++) {
+      in.push_back(static_cast<char>(rand() % 256));
+    }
+  }
+
+  printf("%-24s %10s\n", "kernel", "ns/op");
+  printf("%-24s %10.1f\n", "std::sort (legacy)", bench(inputs, rounds, [](char* out, const std::string& in) {
+    legacySort(out, in.data(), in.size());
+  }));
+  printf("%-24s %10.1f\n", "counting (scalar)", bench(inputs, rounds, [](char* out, const std::string& in) {
+    memcpy(out, in.data(), in.size());
+    sortBytesScalar(out, in.size());
+  }));
+#if defined(__x86_64__)
+  printf("%-24s %10.1f\n", "rank (sse2)", bench(inputs, rounds, [](char* out, const std::string& in) {
+    memcpy(out, in.data(), in.size());
+    sortBytesSSE(out, in.size());
+  }));
+  if (hasAVX2()) {
+    printf("%-24s %10.1f\n", "rank (avx2)", bench(inputs, rounds, [](char* out, const std::string& in) {
+      memcpy(out, in.data(), in.size());
+      sortBytesAVX2(out, in.size());
+    }));
+  }
+#endif
+
+  // whole handler: one request at a time against one batch per iteration
+  std::vector<Message> reqs;
+  std::vector<Message*> req_ptrs;
+  for (auto& in : inputs) {
+    reqs.emplace_back((char*)in.data(), in.size(), MessageType::Request);
+  }
+  for (auto& req : reqs) {
+    req_ptrs.push_back(&req);
+  }
+  std::vector<Message> resps(reqs.size());
+  Handler handler;
+  Arena arena;
+  RequestContext ctx{&arena};
+  auto start = std::chrono::steady_clock::now();
+  for (int r = 0; r < rounds; r++) {
+    for (size_t i = 0; i < reqs.size(); i++) {
+      resps[i] = handler.handlerRequest(req_ptrs[i], &ctx);
+    }
+    arena.reset();
+  }
+  auto mid = std::chrono::steady_clock::now();
+  for (int r = 0; r < rounds; r++) {
+    handler.handlerBatch(req_ptrs.data(), resps.data(), req_ptrs.size(), &ctx);
+    arena.reset();
+  }
+  auto end = std::chrono::steady_clock::now();
+  double n = static_cast<double>(rounds) * reqs.size();
+  printf("%-24s %10.1f\n", "handlerRequest", std::chrono::duration<double, std::nano>(mid - start).count() / n);
+  printf("%-24s %10.1f\n", "handlerBatch", std::chrono::duration<double, std::nano>(end - mid).count() / n);
+}
@@ -0,0 +1,430 @@
+#include <const.h>
+#include <client.h>
+#include <handler.h>
+#include <message.h>
+#include <util.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Open-loop load generator: requests arrive on a schedule whatever the
+// server does, and latency is measured from the scheduled arrival, so a
+// backlog shows up in the tail instead of slowing down the generator.
+// Each connection carries up to --depth requests at once, arrivals beyond
+// that queue in the generator and the wait counts in their latency.
+//
+// The handler mode is a microbenchmark of the handler alone: a thread
+// batches requests from shared memory, there is no framing, call table,
+// coalescing nor server poller. Measure those in rdma mode.
+
+using Clock = std::chrono::steady_clock;
+
+class Options {
+public:
+  std::string mode_{"handler"};  // handler: the handler alone over shared memory, rdma: a real server
+  std::string host_{"127.0.0.1"};
+  std::string port_{"6666"};
+  std::string arrival_{"poisson"};  // poisson or constant
+  uint32_t threads_{1};
+  uint32_t conns_{1};           // per thread
+  uint32_t depth_{8};           // requests outstanding per connection
+  double duration_{2.0};        // seconds per qps step
+  std::vector<double> qps_{10000};
+  std::vector<std::pair<uint32_t, double>> sizes_{{10, 1.0}};  // payload size and weight
+};
+
+// One connection, carrying up to depth requests at once, each in a slot.
+class Channel {
+public:
+  virtual ~Channel() = default;
+  // slot must be done, false if the connection has no room for it now
+  virtual bool post(uint32_t slot, const char* data, uint32_t len) = 0;
+  // true once the request of slot is answered, resp holds the answer
+  virtual bool done(uint32_t slot, Message* resp) = 0;
+};
+
+class RdmaChannel : public Channel {
+public:
+  explicit RdmaChannel(uint32_t depth) : resps_(depth), ids_(depth, -1) {}
+
+  Client* client() { return &client_; }
+
+  bool post(uint32_t slot, const char* data, uint32_t len) override {
+    resps_[slot] = Message();
+    ids_[slot] = client_.callAsync(Method::SortBytes, data, len, &resps_[slot]);
+    return ids_[slot] >= 0;
+  }
+
+  bool done(uint32_t slot, Message* resp) override {
+    if (not client_.done(ids_[slot])) {
+      return false;
+    }
+    *resp = resps_[slot];
+    return true;
+  }
+
+private:
+  Client client_{};
+  std::vector<Message> resps_;
+  std::vector<int> ids_;
+};
+
+// Request slots in shared memory, served by HandlerServer.
+class LocalChannel : public Channel {
+public:
+  enum SlotState : int32_t {
+    Empty,
+    Posted,
+    Answered,
+  };
+
+  explicit LocalChannel(uint32_t depth) : slots_(depth) {}
+
+  bool post(uint32_t slot, const char* data, uint32_t len) override {
+    slots_[slot].req_ = Message((char*)data, len, MessageType::ImmRequest, Method::SortBytes);
+    slots_[slot].state_.store(Posted, std::memory_order_release);
+    return true;
+  }
+
+  bool done(uint32_t slot, Message* resp) override {
+    int32_t state = slots_[slot].state_.load(std::memory_order_acquire);
+    if (state == Posted) {
+      return false;
+    }
+    if (state == Answered) {
+      *resp = slots_[slot].resp_;
+      slots_[slot].state_.store(Empty, std::memory_order_relaxed);
+    }
+    return true;
+  }
+
+private:
+  friend class HandlerServer;
+  class Slot {
+  public:
+    std::atomic_int32_t state_{Empty};
+    Message req_{};
+    Message resp_{};
+  };
+  std::vector<Slot> slots_;
+};
+
+// Polls the local slots and hands the requests of one pass to the handler
+// as a batch. Only the handler is measured, nothing of the rpc path.
+class HandlerServer {
+public:
+  explicit HandlerServer(std::vector<LocalChannel*> channels) : channels_(std::move(channels)) {
+    thread_ = std::thread(&HandlerServer::poll, this);
+  }
+
+  ~HandlerServer() {
+    running_.store(false, std::memory_order_release);
+    thread_.join();
+  }
+
+private:
+  void poll() {
+    std::vector<LocalChannel::Slot*> batch;
+    std::vector<Message*> reqs;
+    std::vector<Message> resps;
+    Arena arena;
+    RequestContext ctx{&arena};
+    while (running_.load(std::memory_order_acquire)) {
+      for (auto channel : channels_) {
+        for (auto& slot : channel->slots_) {
+          if (slot.state_.load(std::memory_order_acquire) == LocalChannel::Posted) {
+            batch.push_back(&slot);
+            reqs.push_back(&slot.req_);
+          }
+        }
+      }
+      if (batch.empty()) {
+        // small ci boxes may have fewer cores than spinning threads
+        std::this_thread::yield();
+        continue;
+      }
+      resps.resize(batch.size());
+      handler_.handlerBatch(reqs.data(), resps.data(), reqs.size(), &ctx);
+      for (size_t i = 0; i < batch.size(); i++) {
+        batch[i]->resp_ = resps[i];
+        batch[i]->state_.store(LocalChannel::Answered, std::memory_order_release);
+      }
+      arena.reset();
+      batch.clear();
+      reqs.clear();
+    }
+  }
+
+  std::vector<LocalChannel*> channels_;
+  Handler handler_{};
+  std::atomic_bool running_{true};
+  std::thread thread_;
+};
+
+class WorkerStats {
+public:
+  uint64_t sent_{};
+  uint64_t errors_{};    // answers of the wrong length
+  uint64_t backlog_{};   // arrivals still queued at the end
+  std::vector<uint64_t> latency_ns_;
+};
+
+// Issue the arrivals of one thread over its channels for duration seconds.
+static WorkerStats runWorker(const Options& opt, std::vector<Channel*>& channels, double rate, uint64_t seed) {
+  WorkerStats stats;
+  std::mt19937_64 rng(seed);
+  std::exponential_distribution<double> poisson(rate);
+  std::vector<double> weights;
+  for (auto& s : opt.sizes_) {
+    weights.push_back(s.second);
+  }
+  std::discrete_distribution<size_t> size_pick(weights.begin(), weights.end());
+  char payload[MESSAGE_BUF_SIZE];
+  for (auto& c : payload) {
+    c = 'a' + rng() % 26;
+  }
+
+  auto interval = [&]() {
+    double sec = opt.arrival_ == "constant" ? 1.0 / rate : poisson(rng);
+    return std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(sec));
+  };
+
+  class InFlight {
+  public:
+    Clock::time_point arrival_;
+    uint32_t len_{};
+    bool busy_{false};
+  };
+  // inflight[i * depth + k] is slot k of channel i
+  std::vector<InFlight> inflight(channels.size() * opt.depth_);
+  std::deque<Clock::time_point> backlog;  // arrived, waiting for a free slot
+
+  auto start = Clock::now();
+  auto end = start + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(opt.duration_));
+  // give the last requests a moment to come back
+  auto drain_end = end + std::chrono::seconds(1);
+  auto next = start + interval();
+  Message resp;
+  for (;;) {
+    auto now = Clock::now();
+    while (next <= now && next < end) {
+      backlog.push_back(next);
+      next += interval();
+    }
+    bool busy = false;
+    bool progress = false;
+    for (size_t j = 0; j < inflight.size(); j++) {
+      Channel* channel = channels[j / opt.depth_];
+      uint32_t slot = j % opt.depth_;
+      if (inflight[j].busy_) {
+        if (not channel->done(slot, &resp)) {
+          busy = true;
+          continue;
+        }
+        auto latency = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - inflight[j].arrival_);
+        stats.latency_ns_.push_back(latency.count());
+        if (resp.dataLen() != inflight[j].len_) {
+          stats.errors_++;
+        }
+        inflight[j].busy_ = false;
+        progress = true;
+      }
+      if (backlog.empty()) {
+        continue;
+      }
+      uint32_t len = opt.sizes_[size_pick(rng)].first;
+      if (channel->post(slot, payload, len)) {
+        inflight[j] = InFlight{backlog.front(), len, true};
+        backlog.pop_front();
+        stats.sent_++;
+        busy = true;
+        progress = true;
+      }
+    }
+    if (now >= end && (not busy || now >= drain_end)) {
+      break;
+    }
+    if (not progress) {
+      std::this_thread::yield();
+    }
+  }
+  stats.backlog_ = backlog.size();
+  return stats;
+}
+
+static double percentile(const std::vector<uint64_t>& sorted, double p) {
+  if (sorted.empty()) {
+    return 0;
+  }
+  size_t idx = std::min(sorted.size() - 1, static_cast<size_t>(p * sorted.size()));
+  return sorted[idx] / 1000.0;
+}
+
+static std::vector<std::string> split(const std::string& s, char sep) {
+  std::vector<std::string> parts;
+  std::stringstream ss(s);
+  std::string part;
+  while (std::getline(ss, part, sep)) {
+    if (not part.empty()) {
+      parts.push_back(part);
+    }
+  }
+  return parts;
+}
+
+static void usage(const char* prog) {
+  fprintf(stderr,
+          "usage: %s [options]\n"
+          "  --mode handler|rdma   handler: the handler alone over shared memory, no rpc path (default)\n"
+          "                        rdma: through Client and Server, 127.0.0.1 works over soft-roce/siw\n"
+          "  --host H --port P     the server of rdma mode\n"
+          "  --threads N           generator threads (default 1)\n"
+          "  --conns N             connections per thread (default 1)\n"
+          "  --depth N             requests outstanding per connection (default 8)\n"
+          "  --arrival poisson|constant\n"
+          "  --qps Q1,Q2,...       target qps of each step of the sweep (default 10000)\n"
+          "  --duration S          seconds per step (default 2)\n"
+          "  --sizes L:W,...       payload length and weight, L <= %u (default 10:1)\n",
+          prog, MESSAGE_BUF_SIZE);
+}
+
+static Options parseOptions(int argc, char* argv[]) {
+  static option long_options[] = {
+    {"mode", required_argument, nullptr, 'm'},
+    {"host", required_argument, nullptr, 'h'},
+    {"port", required_argument, nullptr, 'p'},
+    {"threads", required_argument, nullptr, 't'},
+    {"conns", required_argument, nullptr, 'c'},
+    {"depth", required_argument, nullptr, 'D'},
+    {"arrival", required_argument, nullptr, 'a'},
+    {"qps", required_argument, nullptr, 'q'},
+    {"duration", required_argument, nullptr, 'd'},
+    {"sizes", required_argument, nullptr, 's'},
+    {nullptr, 0, nullptr, 0},
+  };
+  Options opt;
+  int ch;
+  while ((ch = getopt_long(argc, argv, "", long_options, nullptr)) != -1) {
+    switch (ch) {
+    case 'm': opt.mode_ = optarg; break;
+    case 'h': opt.host_ = optarg; break;
+    case 'p': opt.port_ = optarg; break;
+    case 't': opt.threads_ = std::max(1, atoi(optarg)); break;
+    case 'c': opt.conns_ = std::max(1, atoi(optarg)); break;
+    case 'D': opt.depth_ = std::max(1, atoi(optarg)); break;
+    case 'a': opt.arrival_ = optarg; break;
+    case 'd': opt.duration_ = atof(optarg); break;
+    case 'q': {
+      opt.qps_.clear();
+      for (auto& q : split(optarg, ',')) {
+        opt.qps_.push_back(atof(q.c_str()));
+      }
+      break;
+    }
+    case 's': {
+      opt.sizes_.clear();
+      for (auto& s : split(optarg, ',')) {
+        size_t colon = s.find(':');
+        uint32_t len = std::min<uint32_t>(atoi(s.substr(0, colon).c_str()), MESSAGE_BUF_SIZE);
+        double weight = colon == std::string::npos ? 1.0 : atof(s.substr(colon + 1).c_str());
+        opt.sizes_.emplace_back(len, weight);
+      }
+      break;
+    }
+    default:
+      usage(argv[0]);
+      exit(1);
+    }
+  }
+  // local was the name of the handler mode
+  if (opt.mode_ == "local") {
+    opt.mode_ = "handler";
+  }
+  if ((opt.mode_ != "handler" && opt.mode_ != "rdma") || (opt.arrival_ != "poisson" && opt.arrival_ != "constant") ||
+      opt.qps_.empty() || opt.sizes_.empty() || opt.duration_ <= 0 ||
+      std::any_of(opt.qps_.begin(), opt.qps_.end(), [](double qps) { return not (qps > 0); })) {
+    usage(argv[0]);
+    exit(1);
+  }
+  return opt;
+}
+
+int main(int argc, char* argv[]) {
+  Options opt = parseOptions(argc, argv);
+  uint32_t n_channel = opt.threads_ * opt.conns_;
+
+  // the channels stay connected over the whole sweep
+  std::vector<std::unique_ptr<Channel>> channels;
+  std::unique_ptr<HandlerServer> handler_server;
+  if (opt.mode_ == "handler") {
+    std::vector<LocalChannel*> locals;
+    for (uint32_t i = 0; i < n_channel; i++) {
+      auto channel = new LocalChannel(opt.depth_);
+      locals.push_back(channel);
+      channels.emplace_back(channel);
+    }
+    handler_server.reset(new HandlerServer(locals));
+  } else {
+    std::vector<Client*> clients;
+    for (uint32_t i = 0; i < n_channel; i++) {
+      auto channel = new RdmaChannel(opt.depth_);
+      channels.emplace_back(channel);
+      clients.push_back(channel->client());
+      channel->client()->connectAsync(opt.host_.c_str(), opt.port_.c_str());
+    }
+    int connected = Client::waitConnected(clients, DEFAULT_CONNECTION_TIMEOUT * 3);
+    checkEqual(static_cast<uint32_t>(connected), n_channel, "fail to connect all the channels");
+  }
+
+  printf("mode,arrival,threads,conns,depth,target_qps,achieved_qps,sent,completed,errors,backlog,"
+         "p50_us,p99_us,p999_us,max_us\n");
+  uint64_t seed = std::random_device{}();
+  for (double qps : opt.qps_) {
+    std::vector<WorkerStats> results(opt.threads_);
+    std::vector<std::thread> workers;
+    auto start = Clock::now();
+    for (uint32_t t = 0; t < opt.threads_; t++) {
+      workers.emplace_back([&, t]() {
+        std::vector<Channel*> mine;
+        for (uint32_t i = 0; i < opt.conns_; i++) {
+          mine.push_back(channels[t * opt.conns_ + i].get());
+        }
+        results[t] = runWorker(opt, mine, qps / opt.threads_, seed + t);
+      });
+    }
+    for (auto& w : workers) {
+      w.join();
+    }
+    double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+    seed += opt.threads_;
+
+    WorkerStats total;
+    for (auto& r : results) {
+      total.sent_ += r.sent_;
+      total.errors_ += r.errors_;
+      total.backlog_ += r.backlog_;
+      total.latency_ns_.insert(total.latency_ns_.end(), r.latency_ns_.begin(), r.latency_ns_.end());
+    }
+    std::sort(total.latency_ns_.begin(), total.latency_ns_.end());
+    printf("%s,%s,%u,%u,%u,%.0f,%.0f,%" PRIu64 ",%zu,%" PRIu64 ",%" PRIu64 ",%.2f,%.2f,%.2f,%.2f\n",
+           opt.mode_.c_str(), opt.arrival_.c_str(), opt.threads_, opt.conns_, opt.depth_, qps,
+           total.latency_ns_.size() / elapsed, total.sent_, total.latency_ns_.size(), total.errors_, total.backlog_,
+           percentile(total.latency_ns_, 0.5), percentile(total.latency_ns_, 0.99),
+           percentile(total.latency_ns_, 0.999),
+           total.latency_ns_.empty() ? 0.0 : total.latency_ns_.back() / 1000.0);
+    fflush(stdout);
+  }
+  return 0;
+}
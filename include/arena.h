@@ -0,0 +1,42 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include <const.h>
+
+// A bump-pointer allocator owned by one thread. Everything allocated is
+// freed at once by reset(), the blocks are kept, so a warm arena never
+// calls malloc.
+class Arena {
+public:
+  explicit Arena(size_t block_size = ARENA_BLOCK_SIZE);
+  ~Arena();
+  Arena(const Arena&) = delete;
+  Arena& operator=(const Arena&) = delete;
+
+  // valid until the next reset(), align must be a power of two
+  void* alloc(size_t size, size_t align = alignof(max_align_t));
+  template <typename T>
+  T* allocArray(size_t n) {
+    return static_cast<T*>(alloc(n * sizeof(T), alignof(T)));
+  }
+  void reset();
+
+  size_t used();      // bytes handed out since the last reset
+  size_t capacity();  // bytes held
+
+private:
+  class Block {
+  public:
+    char* addr_{nullptr};
+    size_t size_{};
+  };
+
+  void grow(size_t size);
+
+  std::vector<Block> blocks_;
+  size_t block_size_;
+  size_t cur_{};     // the block being bumped
+  size_t offset_{};  // into blocks_[cur_]
+  size_t used_{};
+};
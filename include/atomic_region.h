@@ -0,0 +1,40 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <infiniband/verbs.h>
+#include <device.h>
+#include <const.h>
+
+// What the client needs to run atomics on the region,
+// sent to the client in the private data of rdma_accept().
+class [[gnu::packed]] AtomicLayout {
+public:
+  uint64_t addr_{};
+  uint32_t rkey_{};
+  uint32_t word_num_{};  // 0 means no atomics
+};
+
+// 8-byte words hosted by the server in registered memory, clients update
+// them with rdma fetch-and-add and compare-and-swap, the server cpu is
+// never involved. Sequence numbers, counters and leases live here.
+class AtomicRegion {
+public:
+  explicit AtomicRegion(uint32_t word_num = ATOMIC_WORD_NUM);
+  ~AtomicRegion();
+
+  // what clients have left in the word
+  uint64_t load(uint32_t idx);
+  // the nic atomics are not atomic with the cpu, only set a word no client works on
+  void store(uint32_t idx, uint64_t value);
+
+  // registered once per device, kept until deregisterMR()
+  ibv_mr* registerMR(Device* device);
+  void deregisterMR(Device* device);
+  void* addr();
+  size_t size();
+  AtomicLayout layout(uint32_t rkey);
+
+private:
+  uint64_t* words_;
+  uint32_t word_num_;
+};
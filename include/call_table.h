@@ -0,0 +1,54 @@
+#pragma once
+#include <stdint.h>
+#include <atomic>
+#include <functional>
+#include <const.h>
+#include <message.h>
+
+// One call in flight on a client connection, its slot travels in the
+// header of the request and comes back in the response.
+class PendingCall {
+public:
+  Message req_{};
+  PendingCall* next_{nullptr};  // in the send queue
+  Message* resp_{nullptr};      // filled before done_
+  std::function<void(const char*, uint32_t)> on_chunk_;
+  std::atomic_bool done_{false};
+  // nobody waits for the answer. Set at post for detached calls, or by a
+  // caller giving up; the poller sets it too before filling resp_, so
+  // whoever exchanges it first owns the call and the other frees the slot.
+  std::atomic_bool detached_{false};
+};
+
+// The calls in flight of one client connection, and the queue of calls
+// waiting to be posted. Any thread may acquire a slot and push a call,
+// the thread holding the post role takes them all at once.
+class CallTable {
+public:
+  CallTable() = default;
+  ~CallTable() = default;
+
+  // use the first n slots, before any call
+  void resize(uint32_t n);
+  uint32_t size();
+
+  // a free slot, -1 if all are in flight
+  int acquire();
+  void release(int slot);
+  PendingCall* at(uint32_t slot);
+  bool inFlight(uint32_t slot);
+
+  // lock-free push, the calls stay in their slots until answered
+  void push(PendingCall* call);
+  // all queued calls in fifo order, linked by next_
+  PendingCall* takeAll();
+  bool queued();
+
+private:
+  static_assert(MAX_RECV_WR_NUM <= 64, "the free slots are kept in a uint64_t");
+
+  PendingCall calls_[MAX_RECV_WR_NUM];
+  uint32_t size_{};
+  std::atomic_uint64_t free_{0};
+  std::atomic<PendingCall*> head_{nullptr};  // lifo, reversed by takeAll()
+};
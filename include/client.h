@@ -14,6 +14,9 @@
 #include <list>
 #include <string>
 #include <message.h>
+#include <vector>
+#include <placement.h>
+#include <functional>
 
 class ClientPoller {
 public:
@@ -22,34 +25,145 @@ public:
 
   void registerConn(Connection* conn);
   void deregisterConn();
-  void sendRequest(Message req);
+  // Post a call, any thread may call it. Requests posted by many threads
+  // at once go out in one frame. Return the id to wait for; a call without
+  // resp and on_chunk is detached, -1 is returned and nobody waits.
+  // Block while all call slots are in flight.
+  int sendRequest(Message req, Message* resp = nullptr,
+                  std::function<void(const char*, uint32_t)> on_chunk = nullptr);
+  // the chunks are passed to on_chunk on the poll thread as they arrive,
+  // resp gets the final response, blocking
+  void streamRequest(Message req, std::function<void(const char*, uint32_t)> on_chunk, Message* resp = nullptr);
+  // post without blocking, -1 if all calls are in flight
+  int trySendRequest(Message req, Message* resp);
+  // true once the call is answered, the id is released then,
+  // false for an id that was never posted, like -1
+  bool done(int id);
+  // block until the call is answered, release the id, return at once for -1
+  void wait(int id);
+  // wait until deadline_ns at most, release the id either way. False if
+  // the call is still in flight, its slot is freed once the answer comes.
+  bool waitFor(int id, uint64_t deadline_ns);
+  // one-sided read into dst, blocking, one at a time
+  void readRemote(void* dst, uint64_t remote_addr, uint32_t length, uint32_t rkey);
+  KVLayout remoteKV();
+  // what the server agreed on
+  const ConnParams& params();
+  int postAtomic(ibv_wr_opcode opcode, uint32_t idx, uint64_t compare_add, uint64_t swap, uint64_t* old);
+  bool atomicDone(int id, bool* ok);
+  uint32_t atomicWordNum();
 
-  void run();
+  // the poll thread is pinned by placement if given
+  void run(Placement* placement = nullptr);
   void stop();
   void poll();
+  // poll the connection once, for a thread polling many connections
+  void pollOnce();
 
 private:
+  void post(int slot, Message& req, Message* resp, std::function<void(const char*, uint32_t)> on_chunk);
+
   std::atomic_bool running_{false};
   Spinlock lock_{};
+  Spinlock stream_lock_{};  // one stream at a time
+  Placement* placement_{nullptr};
   Connection* conn_;
   std::thread poll_thread_;
 };
 
 
+enum ConnectState : int32_t {
+  Idle,
+  ResolvingAddr,
+  ResolvingRoute,
+  Connecting,
+  Connected,
+  Failed,
+};
+
+
 // one client can only connect one server
 class Client {
 public:
   Client();
   ~Client();
 
+  // blocking, throw if the connection can't be established
   void connect(const char* host, const char* port);
+  // start connecting and return at once, the handshake is driven by progress()
+  void connectAsync(const char* host, const char* port);
+  // handle the cm events arrived so far without blocking
+  ConnectState progress();
+  ConnectState state();
+  // drive many connecting clients at once, return the number connected
+  static int waitConnected(std::vector<Client*>& clients, int timeout_ms);
+
   rdma_cm_event* waitEvent(rdma_cm_event_type expected);
-  void setupConnection(rdma_cm_id* cm_id, uint32_t n_buffer_page);
+  // propose params() to the server, the connection is sized once it answers
+  void setupConnection(rdma_cm_id* cm_id);
 
   void sendRequest(std::string msg);
 
+  // lookup by one-sided rdma read, fall back to rpc on conflicts or misses
+  bool get(const std::string& key, std::string* value);
+  bool put(const std::string& key, const std::string& value);
+
+  // non-blocking rpc, return the call id, -1 if all calls are in flight,
+  // resp is filled once done(id) returns true. With a timeout the server
+  // answers Expired instead of handling a request it got too late.
+  int callAsync(Method method, const char* data, uint32_t len, Message* resp, uint32_t timeout_us = 0);
+  bool done(int id);
+  // wait for the call for timeout_us at most, the id is released either
+  // way, false if it isn't answered in time
+  bool waitFor(int id, uint32_t timeout_us);
+  // blocking rpc with a deadline, false if no slot is free in time, the
+  // response doesn't come in time, or the server dropped it as Expired
+  bool callFor(Method method, const char* data, uint32_t len, Message* resp, uint32_t timeout_us);
+  // fire and forget, the server sends no response. The call slot is freed
+  // by an ack the server sends once per pass, or piggybacks on its responses.
+  // Block only while all call slots are in flight, false if data is too long.
+  bool sendOneWay(Method method, const char* data, uint32_t len);
+
+  // Remote atomics on word idx of the server's atomic region, done by the
+  // nics without waking the server cpu nor queuing behind handlers.
+  // Async: return the id, -1 if all atomic slots are in flight or idx is
+  // out of range, *old gets the value before the atomic once done.
+  int fetchAddAsync(uint32_t idx, uint64_t add, uint64_t* old);
+  int compareSwapAsync(uint32_t idx, uint64_t expected, uint64_t desired, uint64_t* old);
+  // true once the atomic is complete, the id is released then, never for
+  // an id out of range or released already,
+  // ok is false if the connection broke
+  bool atomicDone(int id, bool* ok = nullptr);
+  // blocking, false if the atomic failed
+  bool fetchAdd(uint32_t idx, uint64_t add, uint64_t* old = nullptr);
+  // blocking, true if the word held expected and holds desired now
+  bool compareSwap(uint32_t idx, uint64_t expected, uint64_t desired, uint64_t* old = nullptr);
+  // 0 if the server offers no atomics
+  uint32_t atomicWordNum();
+
+  // blocking streaming rpc, on_chunk runs on the poll thread for every chunk,
+  // false if the server doesn't stream
+  bool stream(Method method, const std::string& req, std::function<void(const char*, uint32_t)> on_chunk);
+  // stream all the pairs of the server's kv table, return the number of pairs
+  uint64_t scan(std::function<void(const std::string&, const std::string&)> on_pair);
+
+  // configure before connect()
+  Placement* placement();
+  // what the connection asks for: a small client keeps less memory
+  // registered, a bulk one gets more slots and larger frames
+  ConnParams* params();
+  // what the server agreed on, once connected
+  const ConnParams& agreed();
+  // no poll thread of its own, somebody calls poll() once connected
+  void setExternalPoll(bool external);
+  void poll();
+
 private:
-  rdma_cm_id* cm_id_;  // only one qp, so only one cm_id
+  Message call(Message req);
+
+  rdma_cm_id* cm_id_{nullptr};  // only one qp, so only one cm_id
+  ConnectState state_{ConnectState::Idle};
+  Connection* pending_conn_{nullptr};  // until established
   addrinfo* dst_addr_{nullptr};
   rdma_event_channel* cm_event_channel_{nullptr};
 
@@ -60,4 +174,7 @@ private:
 
   // connection related
   ClientPoller poller_{};
+  Placement placement_{};
+  ConnParams params_{};
+  bool external_poll_{false};
 };
@@ -0,0 +1,75 @@
+#pragma once
+#include <client.h>
+#include <misc.h>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+// The owners of the points on a consistent-hash ring, immutable once published.
+class HashRing {
+public:
+  // the server whose next point follows the hash of key
+  Client* find(const char* key, uint32_t key_len);
+
+  std::vector<uint64_t> points_;  // sorted
+  std::vector<Client*> owners_;   // owners_[i] owns points_[i]
+  std::vector<Client*> servers_;  // in the order they were added
+};
+
+// Connections to many servers. A call is routed by its key over a ring of
+// CLUSTER_VNODE_NUM virtual nodes per unit of weight, so adding a server
+// moves only the keys that land on its arcs. One thread polls all the
+// connections.
+class ClusterClient {
+public:
+  ClusterClient();
+  ~ClusterClient();
+
+  // connects in the background, the server joins the ring in connect()
+  void addServer(const char* host, const char* port, uint32_t weight = 1);
+  // wait for the added servers and publish the new ring, blocking,
+  // return the number of servers on the ring
+  uint32_t connect(int timeout_ms = DEFAULT_CONNECTION_TIMEOUT * 3);
+  uint32_t serverNum();
+
+  // the client of the server owning key, nullptr before connect()
+  Client* route(const std::string& key);
+  bool get(const std::string& key, std::string* value);
+  bool put(const std::string& key, const std::string& value);
+  // blocking call to the owner of key
+  Message call(const std::string& key, Method method, const char* data, uint32_t len);
+
+  // scatter-gather: every key goes to its owner as the request data, all
+  // calls are in flight at once, resps[i] answers keys[i]
+  void scatter(Method method, const std::vector<std::string>& keys, std::vector<Message>* resps);
+  // the same request to every server, one response per server in ring order
+  void broadcast(Method method, const char* data, uint32_t len, std::vector<Message>* resps);
+
+private:
+  class Shard {
+  public:
+    std::unique_ptr<Client> client_;
+    std::string name_;  // host:port, where its virtual nodes come from
+    uint32_t weight_{1};
+    bool on_ring_{false};
+    bool claimed_{false};  // waited for by a connect(), which alone may drop it
+  };
+
+  // post on client, waiting for a free call slot
+  int post(Client* client, Method method, const char* data, uint32_t len, Message* resp);
+  void poll();
+
+  Spinlock lock_{};  // shards_, rings_ and polls_
+  std::vector<Shard> shards_;
+  // rings are rare, the old ones are kept so readers never take a lock
+  std::atomic<HashRing*> ring_{nullptr};
+  std::vector<std::unique_ptr<HashRing>> rings_;
+  // the clients on the ring, published and kept like the rings, so the
+  // poll thread never holds lock_ against addServer() and connect()
+  std::atomic<std::vector<Client*>*> polled_{nullptr};
+  std::vector<std::unique_ptr<std::vector<Client*>>> polls_;
+  std::atomic_bool running_{true};
+  std::thread poll_thread_;
+};
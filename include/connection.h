@@ -7,9 +7,20 @@
 #include <event2/event.h>
 #include <server.h>
 #include <misc.h>
+#include <message.h>
+#include <kv_table.h>
+#include <placement.h>
+#include <device.h>
+#include <trace.h>
 #include <handler.h>
+#include <functional>
+#include <vector>
+#include <call_table.h>
+#include <handshake.h>
+#include <atomic_region.h>
 
 class Server;
+class Context;
 
 enum Role : int32_t {
   Error,
@@ -24,6 +35,14 @@ enum State : int32_t {
   HandlingRequest,     // Server
 };
 
+// client: one remote atomic in flight
+class AtomicOp {
+public:
+  uint64_t* old_{nullptr};  // filled before done_
+  bool ok_{false};
+  std::atomic_bool done_{false};
+};
+
 
 class Connection {
 public:
@@ -32,47 +51,187 @@ public:
 
   // for client, the cm_id is local,
   // for server, the cm_id is remote
-  Connection(Role role, rdma_cm_id* cm_id, uint32_t n_buffer_page);
+  // server connections register kv_table so that clients can read it,
+  // and atomics so that clients can update its words,
+  // resources are allocated on the node given by placement.
+  // The qp is sized by params, the agreed params for a server connection,
+  // which is set up at once, the proposal for a client connection.
+  Connection(Role role, rdma_cm_id* cm_id, const ConnParams& params,
+             KVTable* kv_table = nullptr, Placement* placement = nullptr,
+             AtomicRegion* atomics = nullptr);
   ~Connection();
 
+  // cq entries reserved for a qp of params
+  static uint32_t cqeNum(const ConnParams& params);
+  static size_t bufferSize(Role role, const ConnParams& params);
+
+  // take the buffer and post the recv slots for the agreed params,
+  // a client does it once the server has accepted
+  void setup(const ConnParams& params);
+  const ConnParams& params();
+
   rdma_conn_param copyConnParam();
-  void setRkey(uint32_t rkey);
+  void setRemoteKV(const KVLayout& layout);
+  KVLayout getRemoteKV();
+  void setRemoteAtomics(const AtomicLayout& layout);
+  AtomicLayout getRemoteAtomics();
   rdma_cm_id* getCmId();
+  ibv_cq* getCQ();
+  uint32_t getQPNum();
   uint32_t getLKey();
   uint32_t getRKey();
   void* getMRAddr();
+  // the tail of the buffer, landing area of one-sided reads
+  void* getScratchAddr();
+  uint32_t getScratchLen();
+  // where the next read data will be copied to, nullptr to drop it
+  void setSink(void* sink);
+  // the head of the buffer, the recv slots then as many send slots,
+  // each holds one frame of up to frame_msg_num_ messages. Frames are
+  // received behind room for one header, where a compact message gets its header back.
+  uint32_t frameSize();
+  uint32_t slotSize();
+  void* recvSlot(uint32_t idx);
+  void* sendSlot(uint32_t idx);
 
-  void postSend(void* local_addr, uint32_t length, uint32_t lkey, bool need_inline);
+  void postSend(void* local_addr, uint32_t length, uint32_t lkey, bool need_inline, uint32_t imm = 0);
   void postRecv(void* local_addr, uint32_t length, uint32_t lkey);
+  void postRead(void* local_addr, uint32_t length, uint32_t lkey, uint64_t remote_addr, uint32_t rkey);
+  // client: IBV_WR_ATOMIC_FETCH_AND_ADD or IBV_WR_ATOMIC_CMP_AND_SWP on word idx
+  // of the remote atomic region, any thread may call it. Return the id,
+  // -1 if all ATOMIC_SLOT_NUM atomics are in flight or idx is out of range.
+  int postAtomic(ibv_wr_opcode opcode, uint32_t idx, uint64_t compare_add, uint64_t swap, uint64_t* old);
+  // true once the atomic is complete, the id is released then
+  bool atomicDone(int id, bool* ok);
+  // client: held by the one-sided read in flight
   void lock();
   void unlock();
-  
-  void fillMR(void* data, uint32_t size);
 
+  // client: the calls in flight
+  CallTable* calls();
+  // client: post the call in slot. The calls of all threads are queued,
+  // and whoever gets the post role packs them into frames and posts once.
+  void submit(int slot);
+  // copy up to frame_msg_num_ messages into the next send slot and post
+  // them as one frame, held until a slot is free. On a client the post
+  // role must be held.
+  void sendFrame(Message* msgs, uint32_t n);
+
+  // post all the recv slots
   void prepare();
+  // move the qp to the error state, all its posted work requests complete
+  // with flush errors. A server connection is drained by the poller before
+  // it leaves the table, as its cq is shared and routed by qp number.
+  void flush();
+  // work requests posted but not completed yet
+  uint32_t postedNum();
+  // poll the cq of the connection, only for exclusive cqs
   void poll();
+  // handle one work completion of this connection
+  void advance(const ibv_wc &wc);
   void serverAdvance(const ibv_wc &wc);
   void clientAdvance(const ibv_wc &wc);
 
+  // server: the requests received since the last respond(), in order
+  std::vector<Message*>& pendingRequests();
+  uint32_t pendingFrameNum();
+  // server: some pending request has a deadline
+  bool hasDeadlines();
+  // server: answer the pending requests past their deadline at now_ns with
+  // Expired, and ack the one-way ones in the next respond(), without
+  // handling them. The budgets count from since_ns, when the cq of the
+  // requests was last found empty. Return the number dropped.
+  uint32_t dropExpired(uint64_t now_ns, uint64_t since_ns);
+  // server: send resps[i] in answer to reqs[i] packed into frames,
+  // and free the recv slots of all pending requests
+  void respond(Message** reqs, Message* resps, uint32_t n);
+  // server: answer req with stream, owned by the connection from now on
+  void startStream(Message* req, Stream* stream);
+  bool streaming();
+  // server: send chunks while the client has free recv slots,
+  // return false once the stream has ended
+  bool pumpStream();
+
 private:
-  static ibv_qp_init_attr defaultQpInitAttr();
+  static ibv_qp_init_attr defaultQpInitAttr(const ConnParams& params);
+  // post the recv slot of ctx again
+  void repostRecv(Context* ctx);
+  // shrink a frame of one untraced message to its payload, return the length to send
+  uint32_t encodeFrame(void* frame, uint32_t n, uint32_t* imm);
+  // the messages of a received frame, a compact one gets its header back in place,
+  // n is 0 for a malformed frame
+  Message* decodeFrame(Context* ctx, const ibv_wc& wc, uint32_t* n);
+  // client: pack the queued calls into frames, post_lock_ must be held
+  void flushCalls();
+  // client: there are calls to pack, or held frames and a free slot
+  bool sendable();
+  // the next send slot, nullptr while all of them are in flight
+  void* takeSendSlot();
+  void postFrame(void* slot, Message* msgs, uint32_t n);
+  // keep a frame until a send completes, and post the kept ones then
+  void holdFrame(Message* msgs, uint32_t n);
+  void sendHeld();
+  // a send has completed, its slot is free
+  void sendDone();
+  void returnCredits();
+  // client: the connection is broken, release everyone waiting
+  void abortCalls();
+  // client: where the nic puts the old value of atomic slot
+  uint64_t* atomicResult(uint32_t slot);
 
   Role role_{Role::Error};
   State state_{State::Vacant};
   // for client, it presents the local cm_id,
   // for server, it presents the remote(client) cm_id
   rdma_cm_id* cm_id_;
-  ibv_pd* local_pd_;
+  Device* device_;
   ibv_cq* local_cq_;
+  bool shared_cq_{false};
   ibv_qp* local_qp_;
-  uint32_t n_buffer_page_;
-  void* buffer_;
-  ibv_mr* buffer_mr_;
+  uint32_t n_cqe_;
+  ConnParams params_;
+  KVTable* kv_table_;
+  Placement* placement_;
+  AtomicRegion* atomics_;
+  Buffer buffer_;
+  ibv_mr* kv_mr_{nullptr};
+  HandshakeWriter handshake_{};
   rdma_conn_param param_;
-  uint32_t rkey_;
   uint32_t lkey_;
+  KVLayout remote_kv_{};
+  AtomicLayout remote_atomics_{};
+  static_assert(ATOMIC_SLOT_NUM <= 32, "the free atomic slots are kept in a uint32_t");
+  AtomicOp atomic_ops_[ATOMIC_SLOT_NUM];
+  std::atomic_uint32_t atomic_free_{0};
+  void* sink_{nullptr};
+  std::atomic_uint64_t read_wr_{0};  // client: the wr_id of the read holding lock_, set before it is posted
+  CallTable calls_{};
+  Spinlock post_lock_{};      // client: the post role, guards next_send_ and the held frames
+  uint32_t next_send_{};
+  std::atomic_uint32_t send_inflight_{0};
+  // frames waiting for a send slot, in order, held_frames_ counts the
+  // messages of each
+  std::vector<Message> held_msgs_;
+  std::vector<uint32_t> held_frames_;
+  std::atomic_uint32_t held_num_{0};
+  std::atomic_uint32_t posted_{0};      // decremented by advance()
+  std::atomic_bool flushed_{false};     // no more sends nor recvs
+  std::vector<Context*> recv_ctxs_;     // server: the frames of the pending requests
+  std::vector<Message*> pending_reqs_;
+  // server: the budget of each pending request, in ns, 0 for never. It
+  // counts from the earliest the request may have arrived, see dropExpired().
+  std::vector<uint64_t> budgets_;
+  uint32_t deadline_num_{};
+  uint64_t expired_acked_{};    // server: one-way requests dropped, acked in respond()
+  // flow control of streams: the server sends chunks while it holds credits,
+  // the client returns them in batches as it consumes the chunks.
+  // The recv slots beyond the call slots are the window, each call keeps
+  // one for its final response.
+  uint32_t credits_{};
+  uint32_t consumed_{};
+  Stream* stream_{nullptr};     // server: one stream per connection at a time
+  uint32_t stream_slot_{};
+  uint32_t stream_req_id_{};
+  bool stream_traced_{false};
   Spinlock lock_{};
-
-  // hander;
-  Handler handler_{};
 };
@@ -1,13 +1,50 @@
 #pragma once
 #include <stdint.h>
 
-constexpr uint32_t DEFAULT_BACK_LOG  = 8;
+constexpr uint32_t DEFAULT_BACK_LOG  = 256;  // absorb reconnect storms
 constexpr uint32_t MAX_CONNECTION_NUM = 8;
 constexpr uint32_t MAX_QUEUE_SIZE = 256;
 constexpr uint32_t MAX_WORKER_NUM = 2;
 constexpr uint32_t DEFAULT_CQ_CAPACITY = 64;
-constexpr uint32_t MAX_SEND_WR_NUM = 64;
-constexpr uint32_t MAX_RECV_WR_NUM = 64;
-constexpr uint32_t BUFFER_PAGE_SIZE = 65536;
+// the defaults a client proposes, and the limits of the handshake
+constexpr uint16_t HANDSHAKE_VERSION = 2;     // bumped whenever the messages change, 2: the deadline in the header
+constexpr uint32_t CONNECT_DATA_SIZE = 56;     // the private data of rdma_connect() on ib
+constexpr uint32_t ACCEPT_DATA_SIZE = 196;     // the private data of rdma_accept()
+constexpr uint32_t RECV_SLOT_NUM = 16;         // recvs posted per connection
+constexpr uint32_t MIN_RECV_SLOT_NUM = 2;      // one call and one stream chunk
+constexpr uint32_t MAX_RECV_WR_NUM = 64;       // the most recv slots, the call slots are kept in a uint64_t
+constexpr uint32_t ATOMIC_SLOT_NUM = 8;        // remote atomics in flight per client connection
+constexpr uint32_t MAX_SEND_WR_NUM = MAX_RECV_WR_NUM + 1 + ATOMIC_SLOT_NUM;  // a send per slot, one read and the atomics
+constexpr uint32_t FRAME_MESSAGE_NUM = 8;      // messages packed into one send
+constexpr uint32_t MAX_FRAME_MESSAGE_NUM = 16;
+constexpr uint32_t MAX_INLINE_SIZE = 64;       // compact messages up to this size are sent inline
+constexpr uint32_t READ_SCRATCH_SIZE = 4096;   // landing area of one-sided reads
+constexpr uint32_t PREWARM_CONNECTION_NUM = 8;
 constexpr uint32_t DEFAULT_CONNECTION_TIMEOUT = 3000;
-constexpr uint32_t MESSAGE_BUF_SIZE = 64;
\ No newline at end of file
+constexpr uint32_t MESSAGE_BUF_SIZE = 64;
+constexpr uint32_t DEVICE_CQ_CAPACITY = 4096;
+constexpr uint32_t MAX_BUFFER_SLAB_NUM = 8;
+constexpr uint32_t TRACE_RING_SIZE = 65536;
+constexpr uint32_t ARENA_BLOCK_SIZE = 65536;  // scratch memory of a handler batch
+constexpr uint32_t CLUSTER_VNODE_NUM = 128;   // ring points per unit of server weight
+
+// priority classes, 0 the most urgent
+constexpr uint32_t PRIORITY_CLASS_NUM = 2;
+// completions polled per pass and class, in units of DEFAULT_CQ_CAPACITY
+constexpr uint32_t PRIORITY_WEIGHTS[PRIORITY_CLASS_NUM] = {4, 1};
+
+// one-sided kv table
+constexpr uint32_t KV_KEY_SIZE = 16;
+constexpr uint32_t KV_VALUE_SIZE = 32;
+constexpr uint32_t KV_BUCKET_WAYS = 4;
+constexpr uint32_t KV_BUCKET_NUM = 1024;
+constexpr uint32_t KV_READ_RETRY = 3;
+
+// remote atomics
+constexpr uint32_t ATOMIC_WORD_NUM = 1024;
+
+// response cache
+constexpr uint32_t CACHE_ENTRY_NUM = 4096;   // the bound of the cache, fixed once enabled
+constexpr uint32_t CACHE_WAYS = 4;           // entries of one set, evicted by a clock
+constexpr uint32_t CACHE_LOCK_NUM = 64;      // striped over the sets
+constexpr uint32_t CACHE_METHOD_NUM = 32;    // only methods below it can be cached
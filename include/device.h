@@ -0,0 +1,73 @@
+#pragma once
+#include <infiniband/verbs.h>
+#include <stdint.h>
+#include <map>
+#include <vector>
+#include <misc.h>
+
+// A registered buffer handed out by the device pool.
+class Buffer {
+public:
+  void* addr_{nullptr};
+  size_t size_{};
+  ibv_mr* mr_{nullptr};  // shared by all buffers of one slab
+};
+
+// Per-device resources shared by all connections on the device:
+// one protection domain, a pool of CQs and a pool of registered buffers.
+// Devices live as long as the process, so a reconnect finds everything
+// warm and only has to create its QP.
+class Device {
+public:
+  // the process-wide context of the device behind verbs
+  static Device* get(ibv_context* verbs);
+
+  ibv_context* verbs();
+  ibv_pd* pd();
+  int node();
+
+  // A cq with room for n_cqe more entries. Shared cqs are handed to many
+  // qps until full, their completions must be routed by qp_num.
+  // Exclusive cqs serve one qp at a time. Its owner frees the Contexts of
+  // the completions before the release, which drops anything left over.
+  // Shared cqs of different groups are never mixed.
+  ibv_cq* acquireCQ(uint32_t n_cqe, bool shared, uint32_t group = 0);
+  void releaseCQ(ibv_cq* cq, uint32_t n_cqe);
+
+  Buffer acquireBuffer(size_t size);
+  void releaseBuffer(Buffer buffer);
+
+  // fill the pools ahead of time, so a new connection claims them
+  // without registering memory or creating a cq
+  void reserve(uint32_t n_conn, uint32_t n_cqe, bool shared, size_t buffer_size, uint32_t group = 0);
+
+  // register memory owned by someone else once for the whole device
+  ibv_mr* registerMemory(void* addr, size_t len, int access);
+  void deregisterMemory(void* addr);
+
+private:
+  explicit Device(ibv_context* verbs);
+  ~Device() = default;
+
+  // lock_ must be held
+  ibv_cq* createCQ(uint32_t n_cqe, bool shared, uint32_t group);
+  void growBuffers(size_t size, uint32_t n);
+
+  class CQSlot {
+  public:
+    ibv_cq* cq_{nullptr};
+    uint32_t capacity_{};
+    uint32_t used_{};
+    bool shared_{false};
+    uint32_t group_{};
+  };
+
+  ibv_context* verbs_;
+  ibv_pd* pd_;
+  int node_;
+  Spinlock lock_{};
+  std::vector<CQSlot> cqs_;
+  std::map<size_t, std::vector<Buffer>> free_buffers_;  // by size
+  std::map<size_t, size_t> created_;
+  std::map<void*, ibv_mr*> mrs_;
+};
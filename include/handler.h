@@ -1,11 +1,47 @@
+#pragma once
 #include <message.h>
+#include <kv_table.h>
+#include <arena.h>
 
+// What a handler gets besides its requests. The arena belongs to the
+// poller or worker thread and is reset once the responses are posted,
+// so scratch memory needs no malloc nor free. A response body is at most
+// one message and is copied into it, so bodies never live in the arena.
+class RequestContext {
+public:
+  Arena* arena_{nullptr};
+};
+
+// The chunks of a streaming response, produced one at a time. The poller
+// pulls the next chunk only when the client has a free recv slot, so
+// production overlaps with the transfer of the earlier chunks.
+class Stream {
+public:
+  virtual ~Stream() = default;
+  // fill chunk with the next StreamChunk, return false after the last one
+  virtual bool next(Message* chunk) = 0;
+};
+
+// The built-in services. Subclass it and pass it to Server::setHandler()
+// to serve methods of your own, the defaults serve the rest.
 class Handler {
 public:
   Handler();
-  ~Handler();
+  virtual ~Handler();
+
+  void setKVTable(KVTable* kv_table);
+  virtual Message handlerRequest(Message* req, RequestContext* ctx);
+  // handle one poll iteration's worth of requests, resps[i] answers reqs[i]
+  virtual void handlerBatch(Message** reqs, Message* resps, uint32_t n, RequestContext* ctx);
 
-  Message handlerRequest(Message* req);
+  static bool isStreaming(Method method);
+  // the stream answering req, it copies what it needs from req
+  Stream* openStream(Message* req);
 
 private:
-};
\ No newline at end of file
+  Message handleSort(Message* req);
+  Message handleKVGet(Message* req);
+  Message handleKVPut(Message* req);
+
+  KVTable* kv_table_{nullptr};
+};
@@ -0,0 +1,95 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <const.h>
+
+// transports a side supports, a connection uses only the common ones
+enum TransportMode : uint32_t {
+  ModeCompact = 1,   // single-message frames without their header
+  ModeRead = 2,      // one-sided reads of the server's kv table
+  ModeStream = 4,    // streaming responses
+  ModeOneWay = 8,    // requests without response
+  ModeAtomic = 16,   // remote atomics on the server's atomic region
+  ModeAll = ModeCompact | ModeRead | ModeStream | ModeOneWay | ModeAtomic,
+};
+
+// The client proposes its params in the private data of rdma_connect(),
+// the server lowers them to its own limits and returns the agreed copy in
+// rdma_accept(). Both sides size the connection by the agreed copy.
+// New fields go to the end, the section carries its length: an older peer
+// takes the prefix it knows, a newer one keeps the defaults for the rest.
+class [[gnu::packed]] ConnParams {
+public:
+  uint16_t frame_msg_num_{FRAME_MESSAGE_NUM};  // messages packed into one send
+  uint32_t max_msg_size_{MESSAGE_BUF_SIZE};    // payload of one request
+  uint32_t recv_slot_num_{RECV_SLOT_NUM};      // recvs posted by each side, as many send slots
+  uint32_t inline_size_{MAX_INLINE_SIZE};      // sends up to this size go inline
+  uint32_t modes_{ModeAll};
+  // the class of all calls on the connection, 0 the most urgent, a
+  // server limit is the most urgent class it grants
+  uint32_t priority_{0};
+
+  // the largest params this build supports, the default limits of a server
+  static ConnParams limits();
+  // what both sides support, within the limits of this build
+  ConnParams negotiate(const ConnParams& peer) const;
+
+  // the recv slots of a client are split between the answers of its calls
+  // and the window of stream chunks
+  uint32_t callSlotNum() const;
+  uint32_t streamWindow() const;
+  uint32_t frameSize() const;
+  // a frame behind room for one header
+  uint32_t slotSize() const;
+  // the registered memory of a connection: the recv and send slots, and
+  // for a client the results of its atomics and the landing area of reads
+  size_t bufferSize(bool client) const;
+};
+
+// the sections of the private data
+enum HandshakeSection : uint16_t {
+  SectionParams = 1,    // ConnParams
+  // 2 was the rkey of the server's connection buffer, never reused
+  SectionKV = 3,        // KVLayout, if one-sided reads are agreed
+  SectionAtomics = 4,   // AtomicLayout, if atomics are agreed
+};
+
+class [[gnu::packed]] SectionHeader {
+public:
+  uint16_t type_;
+  uint16_t len_;   // of the payload behind
+};
+
+// The private data of rdma_connect() and rdma_accept(): the handshake
+// version, then sections of a type and a length. A reader takes the
+// prefix of a section it knows, keeps the defaults for the fields the
+// peer doesn't send, and skips the sections it doesn't know, so fields
+// and sections are added without a new version. The version changes
+// only with the messages on the wire, a mismatch fails the connection.
+class HandshakeWriter {
+public:
+  HandshakeWriter();
+  // false if it doesn't fit into capacity bytes
+  bool add(HandshakeSection type, const void* data, uint16_t len, uint32_t capacity);
+  const void* data();
+  uint32_t size();
+
+private:
+  char buf_[ACCEPT_DATA_SIZE];
+  uint32_t size_{};
+};
+
+class HandshakeReader {
+public:
+  HandshakeReader(const void* data, uint32_t len);
+  // the peer speaks our version
+  bool valid();
+  uint16_t version();
+  // copy the prefix of section type the peer sent into out, false if absent
+  bool get(HandshakeSection type, void* out, uint32_t size);
+
+private:
+  const char* data_;
+  uint32_t len_;
+  uint16_t version_{};
+};
@@ -0,0 +1,92 @@
+#pragma once
+#include <infiniband/verbs.h>
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <const.h>
+#include <misc.h>
+#include <device.h>
+
+// One slot of the table, exactly one cache line.
+// The version works like a seqlock: odd means the server is writing it.
+// The checksum covers the final (even) version and all other fields,
+// so a torn RDMA READ is always detected by the client.
+class alignas(64) KVEntry {
+public:
+  uint64_t version_;
+  uint32_t checksum_;
+  uint8_t key_len_;    // 0 means the slot is empty
+  uint8_t value_len_;
+  uint16_t reserved_;
+  char key_[KV_KEY_SIZE];
+  char value_[KV_VALUE_SIZE];
+};
+
+static_assert(sizeof(KVEntry) == 64, "KVEntry must be one cache line");
+
+constexpr uint32_t KV_BUCKET_SIZE = KV_BUCKET_WAYS * sizeof(KVEntry);
+
+// The layout the client needs to look up the table by itself,
+// sent to the client in the private data of rdma_accept().
+class [[gnu::packed]] KVLayout {
+public:
+  uint64_t addr_{};
+  uint32_t rkey_{};
+  uint32_t bucket_num_{};   // 0 means the server hosts no table
+  uint32_t bucket_ways_{};
+};
+
+// Where a scan resumes: the slots of the table in order, then the keys
+// the overflow map had when the scan started, so a rehash in between
+// neither skips nor repeats them.
+class KVCursor {
+public:
+  uint64_t slot_{};
+  bool started_{false};
+  std::vector<std::string> overflow_keys_;
+  size_t next_overflow_{};
+};
+
+// A two-choice hash table hosted by the server in registered memory.
+// A key lives in one of its two buckets, so a client finds it with one
+// or two RDMA READs. Keys that find no free slot go to an overflow map,
+// which can only be reached by the RPC path.
+class KVTable {
+public:
+  explicit KVTable(uint32_t n_bucket = KV_BUCKET_NUM);
+  ~KVTable();
+
+  bool put(const char* key, uint32_t key_len, const char* value, uint32_t value_len);
+  bool get(const char* key, uint32_t key_len, std::string* value);
+  // copy at most capacity bytes of the value into value
+  bool get(const char* key, uint32_t key_len, char* value, uint32_t capacity, uint32_t* value_len);
+  bool erase(const char* key, uint32_t key_len);
+  // the next pair at or after *cursor, the cursor moves past it,
+  // start from a new cursor, return false at the end. Overflow keys
+  // erased since the start are skipped.
+  bool scan(KVCursor* cursor, std::string* key, std::string* value);
+
+  // registered once per device, kept until deregisterMR()
+  ibv_mr* registerMR(Device* device);
+  void deregisterMR(Device* device);
+  void* addr();
+  size_t size();
+  KVLayout layout(uint32_t rkey);
+
+  static uint32_t bucketOf(const char* key, uint32_t key_len, uint32_t n_bucket, uint32_t choice);
+  static uint32_t checksum(const KVEntry* entry, uint64_t version);
+  // Check an entry fetched by RDMA READ, return false if it is being written or torn.
+  static bool isStable(const KVEntry* entry);
+
+private:
+  KVEntry* bucket(uint32_t idx);
+  KVEntry* find(const char* key, uint32_t key_len);
+  void write(KVEntry* entry, const char* key, uint32_t key_len, const char* value, uint32_t value_len);
+
+  KVEntry* entries_{nullptr};
+  uint32_t n_bucket_;
+  size_t size_;
+  Spinlock lock_{};  // serialize writers
+  std::unordered_map<std::string, std::string> overflow_;
+};
@@ -13,23 +13,67 @@ enum MessageType {
   Request,
   ImmRequest,
   Response,
+  StreamChunk,  // one chunk of a streaming response, the final Response ends the stream
+  Credit,       // the client has freed recv slots, data is the number as uint32_t
+  OneWay,       // a request without response, its call slot is freed by an Ack
+  Ack,          // the call slots of handled one-way requests, data is a uint64_t bitmap
+  Expired,      // the answer of a request dropped past its deadline
 };
 
+// which service handles the request
+enum Method : uint32_t {
+  SortBytes,
+  KVGet,    // fallback of the one-sided lookup
+  KVPut,
+  KVScan,   // streams all the pairs
+};
+
+// header flags
+constexpr uint32_t MSG_FLAG_TRACED = 1;   // sampled by the client, trace it on the way
+
+// The imm_data of every send. A compact send carries one message without
+// its header: type, method and slot are packed in the imm, the length is
+// the byte_len of the completion. Otherwise the send is a frame of full messages.
+constexpr uint32_t IMM_COMPACT = 1U << 31;
+
 class [[gnu::packed]] Header {
 public:
   uint32_t data_len_{};
   MessageType type_{Dummy};
+  Method method_{SortBytes};
+  uint32_t req_id_{};
+  uint32_t flags_{};
+  uint32_t slot_{};   // the call slot of the client, echoed by the response
+  // the time the caller still waits when the request is sent, 0 for ever.
+  // Relative, so the clocks of client and server needn't agree.
+  uint32_t budget_us_{};
 };
 
 
 class [[gnu::packed]] Message {
 public:
-  explicit Message(char* buf, uint32_t len, MessageType type);
+  Message() = default;
+  explicit Message(char* buf, uint32_t len, MessageType type, Method method = SortBytes);
   ~Message();
 
   char* dataAddr();
   uint32_t dataLen();
   MessageType msgType();
+  Method method();
+  uint32_t reqId();
+  bool traced();
+  // the response carries the id and flags of its request
+  void setTrace(uint32_t req_id, bool traced);
+  uint32_t slot();
+  void setSlot(uint32_t slot);
+  uint32_t budgetUs();
+  void setBudgetUs(uint32_t budget_us);
+
+  // untraced messages without deadline whose header fits in the imm
+  bool compactable();
+  uint32_t compactImm();
+  // rebuild the header in front of a payload received compact
+  void fromCompact(uint32_t imm, uint32_t len);
 
 private:
   Header header_{};
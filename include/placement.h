@@ -0,0 +1,60 @@
+#pragma once
+#include <infiniband/verbs.h>
+#include <stdint.h>
+#include <atomic>
+#include <vector>
+
+class PlacementStats {
+public:
+  int nic_node_{-1};
+  uint32_t local_num_{};
+  uint32_t remote_num_{};   // threads or memory found off the nic node
+};
+
+// Keep pollers, buffers and CQs on the NUMA node of the RDMA device.
+// Without a known node (single node box, soft-roce), nothing is bound
+// unless cores are configured explicitly.
+class Placement {
+public:
+  Placement() = default;
+  ~Placement() = default;
+
+  // discover the node of the device from sysfs, first device wins,
+  // return true if the node becomes known by this call
+  bool bindDevice(ibv_context* verbs);
+  // cores the pollers may run on, empty means all the cores of the nic node
+  void setCores(std::vector<int> cores);
+  int node();
+
+  // pin the calling thread and make its allocations prefer the nic node
+  void bindThread(const char* name);
+  // migrate already touched memory to the nic node
+  void moveMemory(void* addr, size_t len);
+  // check the node of the page at addr, count it in the stats
+  void checkMemory(const void* addr, const char* name);
+  PlacementStats stats();
+
+  static int deviceNode(ibv_context* verbs);
+  static std::vector<int> nodeCores(int node);
+
+private:
+  void record(int node, const char* name);
+
+  std::atomic_int node_{-1};
+  std::vector<int> cores_;
+  std::atomic_uint32_t local_num_{0};
+  std::atomic_uint32_t remote_num_{0};
+};
+
+// Make the allocations of the calling thread prefer node within the scope,
+// so that the pages behind CQs, QPs and MRs created in it are node-local.
+class NodeScope {
+public:
+  explicit NodeScope(int node);
+  ~NodeScope();
+
+private:
+  bool active_{false};
+  int mode_{0};
+  unsigned long mask_[16]{};
+};
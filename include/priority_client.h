@@ -0,0 +1,23 @@
+#pragma once
+#include <client.h>
+#include <const.h>
+#include <memory>
+
+// Connections of every priority class to one server. Each class has its
+// own qp, cq and poll thread, and the server polls and answers the classes
+// by weight, so bulk calls never queue in front of the urgent ones, neither
+// on the wire nor in the server poller.
+class PriorityClient {
+public:
+  PriorityClient();
+
+  // the handshakes of all classes overlap, throw if any class fails
+  void connect(const char* host, const char* port, int timeout_ms = DEFAULT_CONNECTION_TIMEOUT * 3);
+  // the connection of priority class, 0 the most urgent, configure it before connect()
+  Client* at(uint32_t priority);
+  // blocking call in priority class
+  Message call(uint32_t priority, Method method, const char* data, uint32_t len);
+
+private:
+  std::unique_ptr<Client> clients_[PRIORITY_CLASS_NUM];  // the bulk classes disconnect first
+};
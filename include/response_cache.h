@@ -0,0 +1,76 @@
+#pragma once
+#include <stdint.h>
+#include <atomic>
+#include <vector>
+#include <const.h>
+#include <misc.h>
+#include <message.h>
+
+class CacheStats {
+public:
+  uint64_t hits_{};
+  uint64_t misses_{};
+  uint64_t inserts_{};
+  uint64_t evictions_{};   // live entries pushed out by the clock
+  uint64_t expired_{};     // entries found past their ttl
+};
+
+// One cached answer, the request bytes are kept to rule out collisions.
+class CacheEntry {
+public:
+  uint64_t hash_{};
+  uint64_t expire_ns_{};   // 0 means the entry is empty
+  Method method_{SortBytes};
+  uint32_t req_len_{};
+  bool referenced_{false};  // hit since the clock hand last passed
+  char req_[MESSAGE_BUF_SIZE];
+  Message resp_{};          // ready to be copied into a send slot
+};
+
+// The responses of methods that are pure functions of the request bytes,
+// keyed by the method and a hash of the payload. The entries are allocated
+// once, on the first enable(), in sets of CACHE_WAYS: a miss evicts an
+// empty or expired entry of the set, else the clock hand of the set skips
+// the recently hit ones. Any thread may use it, the sets are guarded by
+// striped spinlocks.
+class ResponseCache {
+public:
+  explicit ResponseCache(uint32_t n_entry = CACHE_ENTRY_NUM);
+  ~ResponseCache() = default;
+
+  // cache the responses of method for ttl_us, false if method can't be cached
+  bool enable(Method method, uint32_t ttl_us);
+  // and drop its entries
+  void disable(Method method);
+  bool enabled(Method method);
+  // some method is cached
+  bool active();
+
+  // copy the live response cached for req into resp
+  bool lookup(Message* req, Message* resp, uint64_t now_ns);
+  void insert(Message* req, const Message& resp, uint64_t now_ns);
+  void clear();
+
+  CacheStats stats();
+  // hits / lookups since the start
+  double hitRate();
+
+private:
+  static uint64_t hash(Method method, const char* data, uint32_t len);
+  CacheEntry* find(CacheEntry* set, uint64_t h, Message* req);
+  Spinlock& lockOf(uint32_t set);
+  void drop(Method method);
+
+  uint32_t n_set_;
+  std::vector<CacheEntry> entries_;   // n_set_ * CACHE_WAYS
+  std::vector<uint8_t> hands_;        // the clock hand of each set
+  Spinlock locks_[CACHE_LOCK_NUM];
+  Spinlock enable_lock_{};
+  std::atomic_uint64_t ttl_ns_[CACHE_METHOD_NUM];   // 0: not cached
+  std::atomic_uint32_t enabled_num_{0};
+  std::atomic_uint64_t hits_{0};
+  std::atomic_uint64_t misses_{0};
+  std::atomic_uint64_t inserts_{0};
+  std::atomic_uint64_t evictions_{0};
+  std::atomic_uint64_t expired_{0};
+};
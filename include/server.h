@@ -10,13 +10,36 @@
 #include <signal.h>
 #include <event2/event.h>
 #include <connection.h>
+#include <kv_table.h>
+#include <placement.h>
+#include <handler.h>
+#include <trace.h>
+#include <handshake.h>
+#include <atomic_region.h>
+#include <response_cache.h>
+#include <vector>
 #include <misc.h>
 #include <list>
+#include <map>
+#include <set>
 #include <thread>
 
 class Connection;
 
 
+// An immutable snapshot of the active connections, read by the poller
+// without any lock. Writers copy it, modify the copy and publish it.
+class ConnTable {
+public:
+  // route a completion of a shared cq, nullptr if the connection is gone
+  Connection* find(uint32_t qp_num);
+
+  std::vector<ibv_cq*> cqs_[PRIORITY_CLASS_NUM];  // distinct cqs to poll, by priority class
+  std::vector<uint32_t> qp_nums_;    // sorted
+  std::vector<Connection*> conns_;   // conns_[i] owns qp_nums_[i]
+};
+
+
 class ServerPoller {
 public:
   ServerPoller();
@@ -24,16 +47,74 @@ public:
 
   void registerConn(Connection* conn);
   void deregisterConn(Connection* conn);
+  Handler* handler();
+  // serve the requests by handler instead of the built-in one, before run()
+  void setHandler(Handler* handler);
+  // answer the cached methods without the handler, nullptr for none
+  void setCache(ResponseCache* cache);
+  // completions of priority class polled per pass, in units of DEFAULT_CQ_CAPACITY
+  void setWeight(uint32_t priority, uint32_t weight);
+  // requests dropped past their deadline without being handled
+  uint64_t expiredNum();
 
-  void run();
+  // the poll thread is pinned by placement if given
+  void run(Placement* placement = nullptr);
   void stop();
   void poll();
 
 private:
+  // publish a new table, free the old one after the poller has left it
+  void publish(ConnTable* table, Connection* retired);
+  ConnTable* copyTable();
+  // wait for the poller to start a new pass, if it runs
+  void waitPass();
+  // record point for the sampled requests of the batch
+  void traceBatch(TracePoint point);
+  // poll the cqs of priority class, up to its weight, true if all of them
+  // were found empty
+  bool pollClass(ConnTable* table, uint32_t priority);
+  // unpack the frames received in this pass, handle and answer them,
+  // the frames arrived after since_ns
+  void handleBatch(uint64_t since_ns);
+  // fill the responses of the batch from the cache, and by the handler for the misses
+  void handleCached(RequestContext* ctx);
+  // send the next chunks of all streams
+  void pumpStreams(ConnTable* table);
+
   std::atomic_bool running_{false};
-  Spinlock lock_{};
-  std::list<Connection*> conn_list_;
+  Placement* placement_{nullptr};
+
+  // epoch-based reclamation, the poller is the only reader:
+  // it records the global epoch at the start of every pass, a writer
+  // waits until the poller has passed the epoch of its publication
+  Spinlock lock_{};  // between writers only
+  std::atomic<ConnTable*> table_{nullptr};
+  std::atomic_uint64_t global_epoch_{0};
+  std::atomic_uint64_t reader_epoch_{UINT64_MAX};  // UINT64_MAX: not polling
+  std::map<ibv_cq*, uint32_t> cq_ref_;  // writer side
+
+  ibv_wc wc_[DEFAULT_CQ_CAPACITY];
   std::thread poll_thread_;
+
+  // one handler for all connections, fed a batch per poll iteration,
+  // the requests of batch_conn_[k] start at batch_begin_[k]
+  Handler default_handler_{};
+  Handler* handler_{&default_handler_};
+  std::vector<Connection*> batch_conn_;
+  std::vector<size_t> batch_begin_;
+  std::vector<Message*> batch_req_;
+  std::vector<Message> batch_resp_;
+  Arena arena_{};  // scratch of the handler, reset once a batch is answered
+  ResponseCache* cache_{nullptr};
+  std::vector<size_t> miss_idx_;      // where the misses of the batch go
+  std::vector<Message*> miss_req_;
+  std::vector<Message> miss_resp_;
+  uint32_t stream_num_{};  // connections streaming a response
+  std::atomic_uint64_t expired_num_{0};
+  uint32_t weights_[PRIORITY_CLASS_NUM];
+  // the start of the last pass that drained the cqs of each class, what
+  // is polled later arrived after it, and waited since in the cq
+  uint64_t drained_ns_[PRIORITY_CLASS_NUM]{};
 };
 
 
@@ -45,9 +126,31 @@ public:
 
   void run();
   void handleConnectionEvent(); 
+  void handleCMEvent(rdma_cm_event* cm_ev);
   void handleExitEvent();
+  // fill the device pools, so that accepts only create a qp
+  void prewarm(Device* device);
+
+  // size the connection by what the client asks for, within params()
+  void setupConnection(rdma_cm_event* cm_event);
 
-  void setupConnection(rdma_cm_event* cm_event, uint32_t n_buffer_page);
+  // the table clients can look up by rdma read
+  KVTable* kvTable();
+  // the words clients can update by rdma atomics
+  AtomicRegion* atomics();
+  // the responses of pure methods, nothing is cached until a method is enabled
+  ResponseCache* cache();
+  // serve the requests by handler, it gets the kv table, configure before run()
+  void setHandler(Handler* handler);
+  // configure before run()
+  Placement* placement();
+  // the most a client may get, configure before run()
+  ConnParams* params();
+  // the share of the poller a priority class gets, configure before run(),
+  // default PRIORITY_WEIGHTS
+  void setWeight(uint32_t priority, uint32_t weight);
+  // requests dropped past their deadline so far
+  uint64_t expiredNum();
 
 private:
   static void onConnectionEvent(evutil_socket_t fd, short what, void* arg);
@@ -63,4 +166,11 @@ private:
 
   // poller
   ServerPoller poller_{};
+
+  KVTable kv_table_{};
+  AtomicRegion atomics_{};
+  ResponseCache cache_{};
+  Placement placement_{};
+  ConnParams params_{ConnParams::limits()};
+  std::set<Device*> devices_;  // where the kv table and atomics are registered
 };
@@ -0,0 +1,19 @@
+#pragma once
+#include <stdint.h>
+#include <const.h>
+
+// Sort a short byte array in place, same order as std::sort on char.
+// len must be no more than MESSAGE_BUF_SIZE (64).
+//
+// The kernels are comparison counting sorts: the rank of every byte is the
+// number of smaller bytes plus the number of equal bytes before it, counted
+// with one vector compare per 16/32 bytes, so there is no data-dependent branch.
+void sortBytes(char* data, uint32_t len);
+
+// the kernels, exposed for the benchmark
+void sortBytesScalar(char* data, uint32_t len);
+#if defined(__x86_64__)
+void sortBytesSSE(char* data, uint32_t len);
+void sortBytesAVX2(char* data, uint32_t len);
+bool hasAVX2();
+#endif
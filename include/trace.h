@@ -0,0 +1,54 @@
+#pragma once
+#include <stdint.h>
+#include <atomic>
+#include <const.h>
+
+// where a sampled request is seen on its way
+enum TracePoint : uint8_t {
+  ClientPost,       // the request is posted
+  ClientSendDone,   // the send completion of the request
+  ServerRecv,       // the server polls the request
+  HandlerStart,
+  HandlerEnd,
+  ServerRespPost,   // the response is posted
+  ClientRecv,       // the client polls the response
+};
+
+class TraceEvent {
+public:
+  uint64_t ts_ns_;
+  uint32_t conn_id_;  // the local qp_num
+  uint32_t req_id_;   // unique in the client process, carried in the header
+  TracePoint point_;
+};
+
+// A fixed-size ring per thread, the oldest events are overwritten.
+// A seqlock: writing_ moves before an event is written and head_ after,
+// so the exporter drops the events overwritten while it copied them.
+class TraceRing {
+public:
+  uint32_t tid_{};
+  std::atomic_uint64_t head_{0};
+  std::atomic_uint64_t writing_{0};
+  TraceEvent events_[TRACE_RING_SIZE];  // accessed field by field with atomics
+};
+
+// Sampled per-request tracing. The client decides whether a request is
+// sampled and marks it in the header, so the server traces the same ones.
+// Tracing is off until a sample rate is set, or RDMA_RPC_TRACE_RATE is
+// given in the environment.
+class Tracer {
+public:
+  // the fraction of requests to trace, in [0, 1], can be changed at any time
+  static void setSampleRate(double rate);
+  static double sampleRate();
+  static bool sample();
+  // a process-wide id for a new request
+  static uint32_t nextReqId();
+
+  static void record(TracePoint point, uint32_t conn_id, uint32_t req_id);
+
+  // write the events of all threads as chrome trace json, which
+  // chrome://tracing and ui.perfetto.dev can open
+  static bool exportChromeTrace(const char* path);
+};
@@ -1,4 +1,6 @@
 #pragma once
+#include <stdint.h>
+#include <time.h>
 #include <stdexcept>
 
 inline auto die(const char* err_msg) {
@@ -36,6 +38,12 @@ inline void wCheckEqual(Type ret, Type cmp, const char* err_msg) {
     info(err_msg);
 }
 
+inline uint64_t nowNs() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
 // Warn if ret == type
 template <typename Type>
 inline void wCheckNotEqual(Type ret, Type cmp, const char* err_msg) {
@@ -0,0 +1,66 @@
+#include <arena.h>
+#include <util.h>
+#include <stdlib.h>
+#include <algorithm>
+
+Arena::Arena(size_t block_size) : block_size_(block_size) {
+}
+
+Arena::~Arena() {
+  for (auto& block : blocks_) {
+    free(block.addr_);
+  }
+}
+
+void* Arena::alloc(size_t size, size_t align) {
+  for (; cur_ < blocks_.size(); cur_++, offset_ = 0) {
+    Block& block = blocks_[cur_];
+    uintptr_t begin = reinterpret_cast<uintptr_t>(block.addr_);
+    uintptr_t addr = (begin + offset_ + align - 1) & ~(static_cast<uintptr_t>(align) - 1);
+    if (addr + size <= begin + block.size_) {
+      offset_ = addr + size - begin;
+      used_ += size;
+      return reinterpret_cast<void*>(addr);
+    }
+  }
+  // requests larger than a block get a block of their own
+  grow(std::max(block_size_, size + align));
+  return alloc(size, align);
+}
+
+void Arena::reset() {
+  // a batch that spilled over gets one block large enough next time
+  if (blocks_.size() > 1) {
+    size_t size = capacity();
+    for (auto& block : blocks_) {
+      free(block.addr_);
+    }
+    blocks_.clear();
+    grow(size);
+  }
+  cur_ = 0;
+  offset_ = 0;
+  used_ = 0;
+}
+
+size_t Arena::used() {
+  return used_;
+}
+
+size_t Arena::capacity() {
+  size_t size = 0;
+  for (auto& block : blocks_) {
+    size += block.size_;
+  }
+  return size;
+}
+
+void Arena::grow(size_t size) {
+  Block block;
+  block.addr_ = static_cast<char*>(malloc(size));
+  checkNotEqual(block.addr_, static_cast<char*>(nullptr), "malloc() failed to grow the arena");
+  block.size_ = size;
+  blocks_.push_back(block);
+  cur_ = blocks_.size() - 1;
+  offset_ = 0;
+}
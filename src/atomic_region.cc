@@ -0,0 +1,52 @@
+#include <atomic_region.h>
+#include <util.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+AtomicRegion::AtomicRegion(uint32_t word_num) : word_num_(word_num) {
+  size_t alloc_size = (size() + 4095) / 4096 * 4096;
+  words_ = static_cast<uint64_t*>(aligned_alloc(4096, alloc_size));
+  checkNotEqual(words_, static_cast<uint64_t*>(nullptr), "aligned_alloc() failed to alloc atomic region");
+  memset(words_, 0, alloc_size);
+  info("create atomic region, %u words", word_num_);
+}
+
+AtomicRegion::~AtomicRegion() {
+  free(words_);
+}
+
+uint64_t AtomicRegion::load(uint32_t idx) {
+  assert(idx < word_num_);
+  return __atomic_load_n(&words_[idx], __ATOMIC_ACQUIRE);
+}
+
+void AtomicRegion::store(uint32_t idx, uint64_t value) {
+  assert(idx < word_num_);
+  __atomic_store_n(&words_[idx], value, __ATOMIC_RELEASE);
+}
+
+ibv_mr* AtomicRegion::registerMR(Device* device) {
+  int access = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_ATOMIC;
+  return device->registerMemory(words_, size(), access);
+}
+
+void AtomicRegion::deregisterMR(Device* device) {
+  device->deregisterMemory(words_);
+}
+
+void* AtomicRegion::addr() {
+  return words_;
+}
+
+size_t AtomicRegion::size() {
+  return static_cast<size_t>(word_num_) * sizeof(uint64_t);
+}
+
+AtomicLayout AtomicRegion::layout(uint32_t rkey) {
+  AtomicLayout layout;
+  layout.addr_ = reinterpret_cast<uint64_t>(words_);
+  layout.rkey_ = rkey;
+  layout.word_num_ = word_num_;
+  return layout;
+}
@@ -0,0 +1,66 @@
+#include <call_table.h>
+#include <assert.h>
+
+void CallTable::resize(uint32_t n) {
+  assert(n <= MAX_RECV_WR_NUM);
+  size_ = n;
+  free_.store(n == 64 ? ~0ULL : (1ULL << n) - 1, std::memory_order_release);
+}
+
+uint32_t CallTable::size() {
+  return size_;
+}
+
+int CallTable::acquire() {
+  uint64_t free = free_.load(std::memory_order_relaxed);
+  while (free != 0) {
+    int slot = __builtin_ctzll(free);
+    if (free_.compare_exchange_weak(free, free & ~(1ULL << slot), std::memory_order_acquire)) {
+      PendingCall* call = &calls_[slot];
+      call->next_ = nullptr;
+      call->resp_ = nullptr;
+      call->on_chunk_ = nullptr;
+      call->detached_.store(false, std::memory_order_relaxed);
+      call->done_.store(false, std::memory_order_relaxed);
+      return slot;
+    }
+  }
+  return -1;
+}
+
+void CallTable::release(int slot) {
+  assert(slot >= 0 && static_cast<uint32_t>(slot) < size_);
+  free_.fetch_or(1ULL << slot, std::memory_order_release);
+}
+
+PendingCall* CallTable::at(uint32_t slot) {
+  assert(slot < size_);
+  return &calls_[slot];
+}
+
+bool CallTable::inFlight(uint32_t slot) {
+  return (free_.load(std::memory_order_acquire) & (1ULL << slot)) == 0;
+}
+
+void CallTable::push(PendingCall* call) {
+  PendingCall* head = head_.load(std::memory_order_relaxed);
+  do {
+    call->next_ = head;
+  } while (not head_.compare_exchange_weak(head, call, std::memory_order_release, std::memory_order_relaxed));
+}
+
+PendingCall* CallTable::takeAll() {
+  PendingCall* head = head_.exchange(nullptr, std::memory_order_acquire);
+  PendingCall* fifo = nullptr;
+  while (head != nullptr) {
+    PendingCall* next = head->next_;
+    head->next_ = fifo;
+    fifo = head;
+    head = next;
+  }
+  return fifo;
+}
+
+bool CallTable::queued() {
+  return head_.load(std::memory_order_acquire) != nullptr;
+}
@@ -4,28 +4,58 @@
 #include <iostream>
 #include <mutex>
 #include <message.h>
+#include <string.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <chrono>
+#include <algorithm>
 
 Client::Client() {
   cm_event_channel_ = rdma_create_event_channel();
   checkNotEqual(cm_event_channel_, static_cast<rdma_event_channel*>(nullptr), "rdma_create_event_channel() failed");
+  // progress() must never block, waitEvent() polls the fd instead
+  int flags = fcntl(cm_event_channel_->fd, F_GETFL);
+  int ret = fcntl(cm_event_channel_->fd, F_SETFL, flags | O_NONBLOCK);
+  checkEqual(ret, 0, "fcntl() failed to set the cm event channel non-blocking");
 }
 
 Client::~Client() {
-  // rdma_disconnect will generate an event and a IBV_WC_SEND
-  poller_.stop();
-  int ret = rdma_disconnect(cm_id_);
-  wCheckEqual(ret, 0, "rdma_disconnect() failed to disconnect");
-  rdma_cm_event* cm_event = waitEvent(RDMA_CM_EVENT_DISCONNECTED);
-  wCheckNotEqual(cm_event, static_cast<rdma_cm_event*>(nullptr), "failed to get disconnection event");
-  ret = rdma_ack_cm_event(cm_event);
-  wCheckEqual(ret, 0, "rdma_ack_cm_event() failed to send ack");
-  freeaddrinfo(dst_addr_);
+  if (state_ == ConnectState::Connected) {
+    // rdma_disconnect will generate an event and a IBV_WC_SEND
+    poller_.stop();
+    int ret = rdma_disconnect(cm_id_);
+    wCheckEqual(ret, 0, "rdma_disconnect() failed to disconnect");
+    rdma_cm_event* cm_event = waitEvent(RDMA_CM_EVENT_DISCONNECTED);
+    wCheckNotEqual(cm_event, static_cast<rdma_cm_event*>(nullptr), "failed to get disconnection event");
+    if (cm_event != nullptr) {
+      ret = rdma_ack_cm_event(cm_event);
+      wCheckEqual(ret, 0, "rdma_ack_cm_event() failed to send ack");
+    }
+    poller_.deregisterConn();
+  } else if (pending_conn_ != nullptr) {
+    delete pending_conn_;  // destroys the cm_id as well
+  } else if (cm_id_ != nullptr) {
+    rdma_destroy_id(cm_id_);
+  }
+  if (dst_addr_ != nullptr) {
+    freeaddrinfo(dst_addr_);
+  }
   rdma_destroy_event_channel(cm_event_channel_);
-  poller_.deregisterConn();
+  PlacementStats stats = placement_.stats();
+  info("placement: nic node %d, %u local, %u remote", stats.nic_node_, stats.local_num_, stats.remote_num_);
   info("client disconnect");
 }
 
 void Client::connect(const char* host, const char* port) {
+  connectAsync(host, port);
+  std::vector<Client*> clients{this};
+  waitConnected(clients, DEFAULT_CONNECTION_TIMEOUT * 3);
+  checkEqual(state_, ConnectState::Connected, "fail to establish the connection");
+}
+
+void Client::connectAsync(const char* host, const char* port) {
+  checkEqual(state_, ConnectState::Idle, "the client is already connecting");
 
   int ret = 0;
   ret = rdma_create_id(cm_event_channel_, &cm_id_, nullptr, RDMA_PS_TCP);
@@ -34,33 +64,134 @@ void Client::connect(const char* host, const char* port) {
   ret = getaddrinfo(host, port, nullptr, &dst_addr_);
   checkEqual(ret, 0, "getaddrinfo() failed");
 
-  // When the resolution is completed, the cm_event_channel_ will generate an cm_event. 
+  // When the resolution is completed, the cm_event_channel_ will generate an cm_event,
+  // and progress() takes the next step.
   ret = rdma_resolve_addr(cm_id_, nullptr, dst_addr_->ai_addr, DEFAULT_CONNECTION_TIMEOUT);  // non-block
   checkEqual(ret, 0, "rdma_resolve_addr() failed");
-  rdma_cm_event* cm_event = waitEvent(RDMA_CM_EVENT_ADDR_RESOLVED);  // block
-  checkNotEqual(cm_event, static_cast<rdma_cm_event*>(nullptr), "failed to resolve the address");
-  ret = rdma_ack_cm_event(cm_event);
-  checkEqual(ret, 0, "rdma_ack_cm_event() failed to send ack");
-  info("address resolution is completed");
-
-  // same as above, resolve the route
-  ret = rdma_resolve_route(cm_id_, DEFAULT_CONNECTION_TIMEOUT);
-  checkEqual(ret, 0, "rdma_resolve_route failed");
-  cm_event = waitEvent(RDMA_CM_EVENT_ROUTE_RESOLVED);
-  checkNotEqual(cm_event, static_cast<rdma_cm_event*>(nullptr), "failed to resolve the route");
-  ret = rdma_ack_cm_event(cm_event);
-  checkEqual(ret, 0, "rdma_ack_cm_event() failed to send ack");
-  info("route resolution is completed");
-  
-  setupConnection(cm_id_, 64);
-
-  // run poller
-  poller_.run();
+  state_ = ConnectState::ResolvingAddr;
+}
+
+ConnectState Client::progress() {
+  rdma_cm_event* cm_event = nullptr;
+  while (state_ != ConnectState::Connected && state_ != ConnectState::Failed &&
+         rdma_get_cm_event(cm_event_channel_, &cm_event) == 0) {
+    static const rdma_cm_event_type expected[] = {
+      RDMA_CM_EVENT_ADDR_RESOLVED,   // ResolvingAddr
+      RDMA_CM_EVENT_ROUTE_RESOLVED,  // ResolvingRoute
+      RDMA_CM_EVENT_ESTABLISHED,     // Connecting
+    };
+    rdma_cm_event_type want = expected[state_ - ConnectState::ResolvingAddr];
+    if (cm_event->status != 0 || cm_event->event != want) {
+      info("got: %s, status %d, expected: %s", rdma_event_str(cm_event->event), cm_event->status, rdma_event_str(want));
+      rdma_ack_cm_event(cm_event);
+      state_ = ConnectState::Failed;
+      break;
+    }
+
+    switch (state_) {
+    case ConnectState::ResolvingAddr: {
+      rdma_ack_cm_event(cm_event);
+      info("address resolution is completed");
+      placement_.bindDevice(cm_id_->verbs);
+      int ret = rdma_resolve_route(cm_id_, DEFAULT_CONNECTION_TIMEOUT);
+      checkEqual(ret, 0, "rdma_resolve_route failed");
+      state_ = ConnectState::ResolvingRoute;
+      break;
+    }
+    case ConnectState::ResolvingRoute: {
+      rdma_ack_cm_event(cm_event);
+      info("route resolution is completed");
+      setupConnection(cm_id_);
+      state_ = ConnectState::Connecting;
+      break;
+    }
+    case ConnectState::Connecting: {
+      info("connection is established");
+      // the server answers with the agreed params and its kv table layout,
+      // they never exceed what we asked for
+      HandshakeReader reader(cm_event->param.conn.private_data, cm_event->param.conn.private_data_len);
+      if (not reader.valid()) {
+        info("server speaks handshake version %u, expected %u", reader.version(), HANDSHAKE_VERSION);
+        rdma_ack_cm_event(cm_event);
+        rdma_disconnect(cm_id_);
+        state_ = ConnectState::Failed;
+        break;
+      }
+      ConnParams agreed = pending_conn_->params();
+      KVLayout kv;
+      AtomicLayout atomics;
+      if (not reader.get(SectionParams, &agreed, sizeof(agreed))) {
+        info("server answers without params");
+        rdma_ack_cm_event(cm_event);
+        rdma_disconnect(cm_id_);
+        state_ = ConnectState::Failed;
+        break;
+      }
+      reader.get(SectionKV, &kv, sizeof(kv));
+      reader.get(SectionAtomics, &atomics, sizeof(atomics));
+      pending_conn_->setup(pending_conn_->params().negotiate(agreed));
+      pending_conn_->setRemoteKV(kv);
+      pending_conn_->setRemoteAtomics(atomics);
+      int ret = rdma_ack_cm_event(cm_event);
+      checkEqual(ret, 0, "rdma_ack_cm_event() failed to send ack");
+
+      poller_.registerConn(pending_conn_);
+      pending_conn_ = nullptr;
+      // run poller
+      if (not external_poll_) {
+        poller_.run(&placement_);
+      }
+      state_ = ConnectState::Connected;
+      break;
+    }
+    default: {
+      rdma_ack_cm_event(cm_event);
+      break;
+    }
+    }
+  }
+  return state_;
+}
+
+int Client::waitConnected(std::vector<Client*>& clients, int timeout_ms) {
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+  std::vector<pollfd> fds;
+  std::vector<Client*> waiting;
+  for (;;) {
+    fds.clear();
+    waiting.clear();
+    int connected = 0;
+    for (auto c : clients) {
+      ConnectState state = c->progress();
+      if (state == ConnectState::Connected) {
+        connected++;
+      } else if (state != ConnectState::Failed && state != ConnectState::Idle) {
+        fds.push_back(pollfd{c->cm_event_channel_->fd, POLLIN, 0});
+        waiting.push_back(c);
+      }
+    }
+    auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+    if (waiting.empty() || left.count() <= 0) {
+      return connected;
+    }
+    // all clients wait together, so resolutions and handshakes overlap
+    ::poll(fds.data(), fds.size(), left.count());
+  }
+}
+
+ConnectState Client::state() {
+  return state_;
 }
 
 rdma_cm_event* Client::waitEvent(rdma_cm_event_type expected) {
   rdma_cm_event* cm_event = nullptr;
-  int ret = rdma_get_cm_event(cm_event_channel_, &cm_event);
+  pollfd fd{cm_event_channel_->fd, POLLIN, 0};
+  int ret = ::poll(&fd, 1, DEFAULT_CONNECTION_TIMEOUT);
+  if (ret <= 0) {
+    info("timeout to get cm event");
+    return nullptr;
+  }
+  ret = rdma_get_cm_event(cm_event_channel_, &cm_event);
   if (ret != 0) {
     info("fail to get cm event");
     return nullptr;
@@ -78,16 +209,13 @@ rdma_cm_event* Client::waitEvent(rdma_cm_event_type expected) {
     return cm_event;
 }
 
-void Client::setupConnection(rdma_cm_id* client_id, uint32_t n_buffer_page) {
-  Connection* conn = new Connection(Role::ClientConn, client_id, n_buffer_page);
-  rdma_conn_param param = conn->copyConnParam();
-  int ret = rdma_connect(client_id, &param);
+void Client::setupConnection(rdma_cm_id* client_id) {
+  // the qp is sized by the proposal, the server may only lower it
+  ConnParams proposal = params_.negotiate(ConnParams::limits());
+  pending_conn_ = new Connection(Role::ClientConn, client_id, proposal, nullptr, &placement_);
+  rdma_conn_param param = pending_conn_->copyConnParam();
+  int ret = rdma_connect(client_id, &param);  // non-block, RDMA_CM_EVENT_ESTABLISHED follows
   checkEqual(ret, 0, "rdma_connect() failed");
-  rdma_cm_event* ev = waitEvent(RDMA_CM_EVENT_ESTABLISHED);
-  checkNotEqual(ev, static_cast<rdma_cm_event*>(nullptr), "fail to establish the connection");
-  info("connection is established");
-
-  poller_.registerConn(conn);
 }
 
 void Client::sendRequest(std::string msg) {
@@ -95,6 +223,212 @@ void Client::sendRequest(std::string msg) {
   poller_.sendRequest(req);  
 }
 
+Placement* Client::placement() {
+  return &placement_;
+}
+
+ConnParams* Client::params() {
+  return &params_;
+}
+
+const ConnParams& Client::agreed() {
+  return poller_.params();
+}
+
+void Client::setExternalPoll(bool external) {
+  external_poll_ = external;
+}
+
+void Client::poll() {
+  poller_.pollOnce();
+}
+
+Message Client::call(Message req) {
+  Message resp;
+  poller_.wait(poller_.sendRequest(req, &resp));
+  return resp;
+}
+
+bool Client::get(const std::string& key, std::string* value) {
+  // an empty key matches every empty slot, and the fallback sends the key
+  // as one request, within the key limit of put()
+  if (key.empty() || key.size() > UINT8_MAX || key.size() > poller_.params().max_msg_size_) {
+    return false;
+  }
+  KVLayout layout = poller_.remoteKV();
+  if (layout.bucket_num_ != 0 && layout.bucket_ways_ == KV_BUCKET_WAYS && key.size() <= KV_KEY_SIZE) {
+    KVEntry bucket[KV_BUCKET_WAYS];
+    for (uint32_t retry = 0; retry < KV_READ_RETRY; retry++) {
+      bool conflict = false;
+      uint32_t first = KVTable::bucketOf(key.data(), key.size(), layout.bucket_num_, 0);
+      for (uint32_t choice = 0; choice < 2; choice++) {
+        uint32_t idx = KVTable::bucketOf(key.data(), key.size(), layout.bucket_num_, choice);
+        if (choice == 1 && idx == first) {
+          break;
+        }
+        // a failed read leaves zeros, which look like empty slots
+        memset(bucket, 0, sizeof(bucket));
+        poller_.readRemote(bucket, layout.addr_ + (uint64_t)idx * KV_BUCKET_SIZE, KV_BUCKET_SIZE, layout.rkey_);
+        for (uint32_t i = 0; i < KV_BUCKET_WAYS; i++) {
+          if (not KVTable::isStable(&bucket[i])) {
+            conflict = true;
+            continue;
+          }
+          if (bucket[i].key_len_ == key.size() && memcmp(bucket[i].key_, key.data(), key.size()) == 0) {
+            value->assign(bucket[i].value_, bucket[i].value_len_);
+            return true;
+          }
+        }
+      }
+      if (not conflict) {
+        break;
+      }
+    }
+  }
+
+  // the key may be being written, or only kept in the server's overflow map
+  Message resp = call(Message((char*)key.data(), key.size(), MessageType::ImmRequest, Method::KVGet));
+  if (resp.dataLen() == 0 || resp.dataAddr()[0] == 0) {
+    return false;
+  }
+  value->assign(resp.dataAddr() + 1, resp.dataLen() - 1);
+  return true;
+}
+
+bool Client::put(const std::string& key, const std::string& value) {
+  if (key.empty() || key.size() > UINT8_MAX || 1 + key.size() + value.size() > poller_.params().max_msg_size_) {
+    return false;
+  }
+  char data[MESSAGE_BUF_SIZE];
+  data[0] = static_cast<char>(key.size());
+  memcpy(data + 1, key.data(), key.size());
+  memcpy(data + 1 + key.size(), value.data(), value.size());
+  Message resp = call(Message(data, 1 + key.size() + value.size(), MessageType::ImmRequest, Method::KVPut));
+  return resp.dataLen() == 1 && resp.dataAddr()[0] == 1;
+}
+
+int Client::callAsync(Method method, const char* data, uint32_t len, Message* resp, uint32_t timeout_us) {
+  if (len > poller_.params().max_msg_size_) {
+    return -1;
+  }
+  Message req((char*)data, len, MessageType::ImmRequest, method);
+  req.setBudgetUs(timeout_us);
+  return poller_.trySendRequest(req, resp);
+}
+
+bool Client::done(int id) {
+  return poller_.done(id);
+}
+
+bool Client::waitFor(int id, uint32_t timeout_us) {
+  return poller_.waitFor(id, nowNs() + timeout_us * 1000ULL);
+}
+
+bool Client::callFor(Method method, const char* data, uint32_t len, Message* resp, uint32_t timeout_us) {
+  if (len > poller_.params().max_msg_size_ || timeout_us == 0) {
+    return false;
+  }
+  uint64_t deadline_ns = nowNs() + timeout_us * 1000ULL;
+  int id = -1;
+  for (uint64_t now_ns = nowNs(); now_ns < deadline_ns; now_ns = nowNs()) {
+    // the server gets only what is left after waiting for a slot
+    uint32_t left_us = std::max<uint64_t>(1, (deadline_ns - now_ns) / 1000);
+    if ((id = callAsync(method, data, len, resp, left_us)) >= 0) {
+      break;
+    }
+    std::this_thread::yield();  // all calls are in flight
+  }
+  return id >= 0 && poller_.waitFor(id, deadline_ns) && resp->msgType() != Expired;
+}
+
+int Client::fetchAddAsync(uint32_t idx, uint64_t add, uint64_t* old) {
+  return poller_.postAtomic(IBV_WR_ATOMIC_FETCH_AND_ADD, idx, add, 0, old);
+}
+
+int Client::compareSwapAsync(uint32_t idx, uint64_t expected, uint64_t desired, uint64_t* old) {
+  return poller_.postAtomic(IBV_WR_ATOMIC_CMP_AND_SWP, idx, expected, desired, old);
+}
+
+bool Client::atomicDone(int id, bool* ok) {
+  return poller_.atomicDone(id, ok);
+}
+
+bool Client::fetchAdd(uint32_t idx, uint64_t add, uint64_t* old) {
+  if (idx >= poller_.atomicWordNum()) {
+    return false;
+  }
+  int id = -1;
+  while ((id = fetchAddAsync(idx, add, old)) < 0) {
+    std::this_thread::yield();  // all atomic slots are in flight
+  }
+  bool ok = false;
+  while (not atomicDone(id, &ok)) {
+    std::this_thread::yield();
+  }
+  return ok;
+}
+
+bool Client::compareSwap(uint32_t idx, uint64_t expected, uint64_t desired, uint64_t* old) {
+  if (idx >= poller_.atomicWordNum()) {
+    return false;
+  }
+  uint64_t value = 0;
+  int id = -1;
+  while ((id = compareSwapAsync(idx, expected, desired, &value)) < 0) {
+    std::this_thread::yield();
+  }
+  bool ok = false;
+  while (not atomicDone(id, &ok)) {
+    std::this_thread::yield();
+  }
+  if (old != nullptr) {
+    *old = value;
+  }
+  return ok && value == expected;
+}
+
+uint32_t Client::atomicWordNum() {
+  return poller_.atomicWordNum();
+}
+
+bool Client::sendOneWay(Method method, const char* data, uint32_t len) {
+  if (len > poller_.params().max_msg_size_) {
+    return false;
+  }
+  // a server without one-way requests answers, the response frees the slot
+  MessageType type = (poller_.params().modes_ & ModeOneWay) ? MessageType::OneWay : MessageType::ImmRequest;
+  poller_.sendRequest(Message((char*)data, len, type, method));
+  return true;
+}
+
+bool Client::stream(Method method, const std::string& req, std::function<void(const char*, uint32_t)> on_chunk) {
+  if (not (poller_.params().modes_ & ModeStream)) {
+    return false;
+  }
+  uint32_t len = std::min<uint32_t>(req.size(), poller_.params().max_msg_size_);
+  poller_.streamRequest(Message((char*)req.data(), len, MessageType::ImmRequest, method), std::move(on_chunk));
+  return true;
+}
+
+uint64_t Client::scan(std::function<void(const std::string&, const std::string&)> on_pair) {
+  uint64_t n = 0;
+  stream(Method::KVScan, "", [&](const char* data, uint32_t len) {
+    // [key_len(1B)][value_len(1B)][key][value]...
+    uint32_t pos = 0;
+    while (pos + 2 <= len) {
+      uint32_t key_len = static_cast<uint8_t>(data[pos]);
+      uint32_t value_len = static_cast<uint8_t>(data[pos + 1]);
+      if (pos + 2 + key_len + value_len > len) {
+        break;
+      }
+      on_pair(std::string(data + pos + 2, key_len), std::string(data + pos + 2 + key_len, value_len));
+      pos += 2 + key_len + value_len;
+      n++;
+    }
+  });
+  return n;
+}
+
 
 // /* ClientPoller */
 ClientPoller::ClientPoller() {
@@ -115,15 +449,117 @@ void ClientPoller::deregisterConn() {
   delete conn_;
 }
 
-void ClientPoller::sendRequest(Message req) {
-  conn_->lock(); // unlock when receive response;
-  conn_->fillMR((void*)&req, sizeof(req));
+int ClientPoller::sendRequest(Message req, Message* resp, std::function<void(const char*, uint32_t)> on_chunk) {
+  int slot = -1;
+  while ((slot = conn_->calls()->acquire()) < 0) {
+    std::this_thread::yield();  // all calls are in flight
+  }
+  bool detached = resp == nullptr && not on_chunk;
+  post(slot, req, resp, std::move(on_chunk));
+  return detached ? -1 : slot;
+}
+
+void ClientPoller::streamRequest(Message req, std::function<void(const char*, uint32_t)> on_chunk, Message* resp) {
+  // the server keeps one stream window per connection
+  std::lock_guard<Spinlock> lock(stream_lock_);
+  wait(sendRequest(req, resp, std::move(on_chunk)));
+}
+
+int ClientPoller::trySendRequest(Message req, Message* resp) {
+  int slot = conn_->calls()->acquire();
+  if (slot < 0) {
+    return -1;
+  }
+  post(slot, req, resp, nullptr);
+  return slot;
+}
+
+bool ClientPoller::done(int id) {
+  // -1 of a detached or failed post is never answered
+  if (id < 0 || static_cast<uint32_t>(id) >= conn_->calls()->size()) {
+    return false;
+  }
+  PendingCall* call = conn_->calls()->at(id);
+  if (not call->done_.load(std::memory_order_acquire)) {
+    return false;
+  }
+  conn_->calls()->release(id);
+  return true;
+}
+
+void ClientPoller::wait(int id) {
+  if (id < 0) {
+    return;  // nothing to wait for
+  }
+  while (not done(id)) {
+    std::this_thread::yield();
+  }
+}
+
+bool ClientPoller::waitFor(int id, uint64_t deadline_ns) {
+  if (id < 0) {
+    return false;
+  }
+  while (not done(id)) {
+    if (nowNs() < deadline_ns) {
+      std::this_thread::yield();
+      continue;
+    }
+    // give up: the poller frees the slot once the answer comes. If the
+    // poller has taken the call first, the answer is being filled in.
+    if (not conn_->calls()->at(id)->detached_.exchange(true)) {
+      return false;
+    }
+    wait(id);
+  }
+  return true;
+}
+
+void ClientPoller::post(int slot, Message& req, Message* resp, std::function<void(const char*, uint32_t)> on_chunk) {
+  PendingCall* call = conn_->calls()->at(slot);
+  call->resp_ = resp;
+  call->detached_.store(resp == nullptr && not on_chunk, std::memory_order_relaxed);
+  call->on_chunk_ = std::move(on_chunk);
+  req.setSlot(slot);
+  req.setTrace(Tracer::nextReqId(), Tracer::sample());
+  call->req_ = req;
   info("post send reqeust, req data is: %s", req.dataAddr());
-  conn_->postSend(conn_->getMRAddr(), sizeof(req),  conn_->getLKey(), false);
+  conn_->submit(slot);
+}
+
+void ClientPoller::readRemote(void* dst, uint64_t remote_addr, uint32_t length, uint32_t rkey) {
+  assert(length <= conn_->getScratchLen());
+  conn_->lock(); // unlock when the read completes
+  conn_->setSink(dst);
+  conn_->postRead(conn_->getScratchAddr(), length, conn_->getLKey(), remote_addr, rkey);
+  // the lock is only released by the poller once the read completes
+  conn_->lock();
+  conn_->unlock();
 }
 
+KVLayout ClientPoller::remoteKV() {
+  return conn_->getRemoteKV();
+}
+
+const ConnParams& ClientPoller::params() {
+  return conn_->params();
+}
+
+int ClientPoller::postAtomic(ibv_wr_opcode opcode, uint32_t idx, uint64_t compare_add, uint64_t swap, uint64_t* old) {
+  return conn_->postAtomic(opcode, idx, compare_add, swap, old);
+}
+
+bool ClientPoller::atomicDone(int id, bool* ok) {
+  return conn_->atomicDone(id, ok);
+}
 
-void ClientPoller::run() {
+uint32_t ClientPoller::atomicWordNum() {
+  return conn_->getRemoteAtomics().word_num_;
+}
+
+
+void ClientPoller::run(Placement* placement) {
+  placement_ = placement;
   running_.store(true, std::memory_order_release);
   poll_thread_ = std::thread(&ClientPoller::poll, this);
   info("start running client poller");
@@ -138,8 +574,15 @@ void ClientPoller::stop() {
 }
 
 void ClientPoller::poll() {
+  if (placement_ != nullptr) {
+    placement_->bindThread("client poller");
+  }
   while (running_.load(std::memory_order_acquire)) {
-    std::lock_guard<Spinlock> lock(lock_);
-    conn_->poll();
+    pollOnce();
   }
+}
+
+void ClientPoller::pollOnce() {
+  std::lock_guard<Spinlock> lock(lock_);
+  conn_->poll();
 }
\ No newline at end of file
@@ -0,0 +1,202 @@
+#include <cluster.h>
+#include <util.h>
+#include <const.h>
+#include <algorithm>
+#include <mutex>
+
+// FNV-1a with a splitmix64 finalizer, unrelated to the bucket hash of the
+// kv table, so the keys of one server still spread over all its buckets
+static uint64_t ringHash(const char* data, size_t len) {
+  uint64_t h = 14695981039346656037ULL;
+  for (size_t i = 0; i < len; i++) {
+    h ^= static_cast<uint8_t>(data[i]);
+    h *= 1099511628211ULL;
+  }
+  h ^= h >> 30;
+  h *= 0xbf58476d1ce4e5b9ULL;
+  h ^= h >> 27;
+  h *= 0x94d049bb133111ebULL;
+  h ^= h >> 31;
+  return h;
+}
+
+/* HashRing */
+Client* HashRing::find(const char* key, uint32_t key_len) {
+  if (points_.empty()) {
+    return nullptr;
+  }
+  auto it = std::lower_bound(points_.begin(), points_.end(), ringHash(key, key_len));
+  return owners_[it == points_.end() ? 0 : it - points_.begin()];
+}
+
+
+/* ClusterClient */
+ClusterClient::ClusterClient() {
+  poll_thread_ = std::thread(&ClusterClient::poll, this);
+}
+
+ClusterClient::~ClusterClient() {
+  running_.store(false, std::memory_order_release);
+  poll_thread_.join();
+  // the clients disconnect one by one
+  shards_.clear();
+}
+
+void ClusterClient::addServer(const char* host, const char* port, uint32_t weight) {
+  Shard shard;
+  shard.client_.reset(new Client());
+  shard.client_->setExternalPoll(true);
+  shard.name_ = std::string(host) + ":" + port;
+  shard.weight_ = std::max(1U, weight);
+  shard.client_->connectAsync(host, port);
+  std::lock_guard<Spinlock> lock(lock_);
+  shards_.push_back(std::move(shard));
+}
+
+uint32_t ClusterClient::connect(int timeout_ms) {
+  std::vector<Client*> pending;
+  {
+    std::lock_guard<Spinlock> lock(lock_);
+    for (auto& shard : shards_) {
+      if (not shard.on_ring_ && not shard.claimed_) {
+        shard.claimed_ = true;
+        pending.push_back(shard.client_.get());
+      }
+    }
+  }
+  // the handshakes of all new servers overlap
+  Client::waitConnected(pending, timeout_ms);
+
+  std::vector<std::pair<uint64_t, Client*>> points;
+  HashRing* ring = new HashRing();
+  // built and published in one go, so concurrent connects publish in order
+  std::lock_guard<Spinlock> lock(lock_);
+  std::vector<Client*>* polled = polled_.load(std::memory_order_relaxed);
+  std::vector<Client*>* next = new std::vector<Client*>();
+  if (polled != nullptr) {
+    *next = *polled;
+  }
+  for (auto it = shards_.begin(); it != shards_.end();) {
+    Client* client = it->client_.get();
+    // a server added meanwhile, or waited for by another connect(), is
+    // still connecting, the connect() that claimed it takes it
+    if (not it->on_ring_ && (not it->claimed_ || std::find(pending.begin(), pending.end(), client) == pending.end())) {
+      ++it;
+      continue;
+    }
+    if (not it->on_ring_ && client->state() != ConnectState::Connected) {
+      info("fail to connect %s, left out of the ring", it->name_.c_str());
+      it = shards_.erase(it);
+      continue;
+    }
+    if (not it->on_ring_) {
+      it->on_ring_ = true;
+      next->push_back(client);
+    }
+    for (uint32_t v = 0; v < it->weight_ * CLUSTER_VNODE_NUM; v++) {
+      std::string vnode = it->name_ + "#" + std::to_string(v);
+      points.emplace_back(ringHash(vnode.data(), vnode.size()), client);
+    }
+    ring->servers_.push_back(client);
+    ++it;
+  }
+  std::sort(points.begin(), points.end());
+  for (auto& point : points) {
+    ring->points_.push_back(point.first);
+    ring->owners_.push_back(point.second);
+  }
+  // clients only ever join, the old lists stay valid for the poll thread
+  polls_.emplace_back(next);
+  polled_.store(next, std::memory_order_release);
+  rings_.emplace_back(ring);
+  ring_.store(ring, std::memory_order_release);
+  info("the ring has %zu servers, %zu points", ring->servers_.size(), ring->points_.size());
+  return ring->servers_.size();
+}
+
+uint32_t ClusterClient::serverNum() {
+  HashRing* ring = ring_.load(std::memory_order_acquire);
+  return ring == nullptr ? 0 : ring->servers_.size();
+}
+
+Client* ClusterClient::route(const std::string& key) {
+  HashRing* ring = ring_.load(std::memory_order_acquire);
+  return ring == nullptr ? nullptr : ring->find(key.data(), key.size());
+}
+
+bool ClusterClient::get(const std::string& key, std::string* value) {
+  Client* client = route(key);
+  return client != nullptr && client->get(key, value);
+}
+
+bool ClusterClient::put(const std::string& key, const std::string& value) {
+  Client* client = route(key);
+  return client != nullptr && client->put(key, value);
+}
+
+Message ClusterClient::call(const std::string& key, Method method, const char* data, uint32_t len) {
+  Message resp;
+  Client* client = route(key);
+  int id = client != nullptr ? post(client, method, data, len, &resp) : -1;
+  while (id >= 0 && not client->done(id)) {
+    std::this_thread::yield();
+  }
+  return resp;
+}
+
+void ClusterClient::scatter(Method method, const std::vector<std::string>& keys, std::vector<Message>* resps) {
+  resps->assign(keys.size(), Message());
+  std::vector<Client*> clients(keys.size());
+  std::vector<int> ids(keys.size());
+  for (size_t i = 0; i < keys.size(); i++) {
+    clients[i] = route(keys[i]);
+    ids[i] = clients[i] != nullptr ? post(clients[i], method, keys[i].data(), keys[i].size(), &(*resps)[i]) : -1;
+  }
+  for (size_t i = 0; i < keys.size(); i++) {
+    while (ids[i] >= 0 && not clients[i]->done(ids[i])) {
+      std::this_thread::yield();
+    }
+  }
+}
+
+void ClusterClient::broadcast(Method method, const char* data, uint32_t len, std::vector<Message>* resps) {
+  HashRing* ring = ring_.load(std::memory_order_acquire);
+  if (ring == nullptr) {
+    resps->clear();
+    return;
+  }
+  resps->assign(ring->servers_.size(), Message());
+  std::vector<int> ids(ring->servers_.size());
+  for (size_t i = 0; i < ids.size(); i++) {
+    ids[i] = post(ring->servers_[i], method, data, len, &(*resps)[i]);
+  }
+  for (size_t i = 0; i < ids.size(); i++) {
+    while (ids[i] >= 0 && not ring->servers_[i]->done(ids[i])) {
+      std::this_thread::yield();
+    }
+  }
+}
+
+int ClusterClient::post(Client* client, Method method, const char* data, uint32_t len, Message* resp) {
+  if (len > client->agreed().max_msg_size_) {
+    return -1;
+  }
+  int id = -1;
+  while ((id = client->callAsync(method, data, len, resp)) < 0) {
+    std::this_thread::yield();  // all calls to this server are in flight
+  }
+  return id;
+}
+
+void ClusterClient::poll() {
+  while (running_.load(std::memory_order_acquire)) {
+    std::vector<Client*>* polled = polled_.load(std::memory_order_acquire);
+    if (polled == nullptr || polled->empty()) {
+      std::this_thread::yield();
+      continue;
+    }
+    for (auto client : *polled) {
+      client->poll();
+    }
+  }
+}
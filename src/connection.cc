@@ -6,145 +6,467 @@
 #include <message.h>
 #include <assert.h>
 #include <context.h>
+#include <algorithm>
+#include <chrono>
+#include <arpa/inet.h>
+
+// the answer of the server with every section
+static_assert(sizeof(HANDSHAKE_VERSION) + 3 * sizeof(SectionHeader) + sizeof(ConnParams) +
+              sizeof(KVLayout) + sizeof(AtomicLayout) <= ACCEPT_DATA_SIZE,
+              "the answer outgrows the private data of rdma_accept()");
 
 /* Connection */
-Connection::Connection(Role role, rdma_cm_id* cm_id, uint32_t n_buffer_page)
+Connection::Connection(Role role, rdma_cm_id* cm_id, const ConnParams& params,
+                       KVTable* kv_table, Placement* placement, AtomicRegion* atomics)
     : role_(role),
       cm_id_(cm_id),
-      n_buffer_page_(n_buffer_page) {
+      n_cqe_(cqeNum(params)),
+      params_(params),
+      kv_table_(kv_table),
+      placement_(placement),
+      atomics_(atomics) {
 
   info("start new connection");
+  // the qp is first touched below, make it nic-local
+  NodeScope scope(placement != nullptr ? placement->node() : -1);
 
-  // create pd
+  // pd, cq and mr come from the device, only the qp is our own.
+  // server connections share cqs, so the poller polls one cq for many clients,
+  // but only of the same priority class
   int ret = 0;
-  local_pd_ = ibv_alloc_pd(cm_id_->verbs);
-  checkNotEqual(local_pd_, static_cast<ibv_pd*>(nullptr), "ibv_alloc_pd() failed, server_pd_ == nullptr"); 
-
-  // create cq
-  local_cq_ = ibv_create_cq(cm_id_->verbs, DEFAULT_CQ_CAPACITY, this, nullptr, 0);
-  checkNotEqual(local_cq_, static_cast<ibv_cq*>(nullptr), "ibv_create_cq() failed, server_cq_ == nullptr");
+  device_ = Device::get(cm_id_->verbs);
+  shared_cq_ = role_ == Role::ServerConn;
+  local_cq_ = device_->acquireCQ(n_cqe_, shared_cq_, params_.priority_);
   cm_id_->recv_cq = local_cq_;
   cm_id_->send_cq = local_cq_;
-  info("create protection domain(pd) and completion queue(cq)");
 
-  ibv_qp_init_attr init_attr = defaultQpInitAttr();
+  ibv_qp_init_attr init_attr = defaultQpInitAttr(params_);
   init_attr.send_cq = local_cq_;
   init_attr.recv_cq = local_cq_;
 
   // create qp
   // rdma_create_qp() will create a qp and store it's address to cm_id->qp.
   // we should record the qp in Connection.
-  ret = rdma_create_qp(cm_id_, local_pd_, &init_attr);
+  ret = rdma_create_qp(cm_id_, device_->pd(), &init_attr);
   local_qp_ = cm_id_->qp;
   checkEqual(ret, 0, "rdma_create_qp() failed");
   info("create queue pair(qp)");
 
-  // create mr
-  size_t size = n_buffer_page * BUFFER_PAGE_SIZE;
-  buffer_ = malloc(size);
-  checkNotEqual(buffer_, static_cast<void*>(nullptr), "malloc() failed to alloc buffer");
-
-  int access = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE;
-  buffer_mr_ = ibv_reg_mr(local_pd_, buffer_, size, access);
-  checkNotEqual(buffer_mr_, static_cast<ibv_mr*>(nullptr), "ibv_reg_mr() falied, buffer_mr_ == nullptr");
-  info("create memory region(mr), size is %zu", size);
-  
-  // set param
+  // set param, the client proposes its params
+  bool fit = handshake_.add(SectionParams, &params_, sizeof(params_), CONNECT_DATA_SIZE);
+  checkEqual(fit, true, "the params don't fit into the private data");
   memset(&param_, 0, sizeof(rdma_conn_param));
-  param_.private_data = reinterpret_cast<void*>(&(buffer_mr_->rkey));
-  param_.private_data_len = sizeof(buffer_mr_->rkey);
+  param_.private_data = handshake_.data();
+  param_.private_data_len = handshake_.size();
   param_.responder_resources = 16;
   param_.initiator_depth = 16;
   param_.rnr_retry_count = 7;
   info("initialize connection parameters");
-  
+
+  if (role_ == Role::ServerConn) {
+    setup(params_);
+  }
+}
+
+void Connection::setup(const ConnParams& params) {
+  params_ = params;
+  calls_.resize(role_ == Role::ClientConn ? params_.callSlotNum() : 0);
+  if (role_ == Role::ClientConn && (params_.modes_ & ModeAtomic)) {
+    atomic_free_.store((1U << ATOMIC_SLOT_NUM) - 1, std::memory_order_release);
+  }
+  credits_ = params_.streamWindow();
+
+  // take a registered buffer of exactly the agreed size from the pool
+  buffer_ = device_->acquireBuffer(bufferSize(role_, params_));
+  if (placement_ != nullptr) {
+    placement_->checkMemory(buffer_.addr_, "connection buffer");
+  }
+  info("take a buffer of %zu bytes, %u recv slots of %u messages",
+       buffer_.size_, params_.recv_slot_num_, params_.frame_msg_num_);
+
+  // the server answers with the agreed params, and exposes the kv table
+  if (role_ == Role::ServerConn) {
+    handshake_ = HandshakeWriter();
+    bool fit = handshake_.add(SectionParams, &params_, sizeof(params_), ACCEPT_DATA_SIZE);
+    if (kv_table_ != nullptr && (params_.modes_ & ModeRead)) {
+      kv_mr_ = kv_table_->registerMR(device_);
+      KVLayout layout = kv_table_->layout(kv_mr_->rkey);
+      fit = fit && handshake_.add(SectionKV, &layout, sizeof(layout), ACCEPT_DATA_SIZE);
+      info("register kv table, rkey is %u", kv_mr_->rkey);
+    }
+    if (atomics_ != nullptr && (params_.modes_ & ModeAtomic)) {
+      ibv_mr* mr = atomics_->registerMR(device_);
+      AtomicLayout layout = atomics_->layout(mr->rkey);
+      fit = fit && handshake_.add(SectionAtomics, &layout, sizeof(layout), ACCEPT_DATA_SIZE);
+    }
+    checkEqual(fit, true, "the answer doesn't fit into the private data");
+    param_.private_data = handshake_.data();
+    param_.private_data_len = handshake_.size();
+  }
+
   // prepare recv
   prepare();
   info("connection prepares");
 }
 
+const ConnParams& Connection::params() {
+  return params_;
+}
+
 Connection::~Connection() {
 
   int ret = 0;
 
   //clear the memory
-  memset(buffer_mr_->addr, 0 ,buffer_mr_->length);
+  if (buffer_.addr_ != nullptr) {
+    memset(buffer_.addr_, 0, buffer_.size_);
+  }
+
+  // every posted work request comes back before the qp is gone, so its
+  // Context is freed and a qp reusing the number never sees our completions.
+  // The poller has drained a shared cq already, see flush().
+  if (not shared_cq_) {
+    flush();
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(DEFAULT_CONNECTION_TIMEOUT);
+    ibv_wc wc[DEFAULT_CQ_CAPACITY];
+    while (posted_.load(std::memory_order_acquire) > 0 && std::chrono::steady_clock::now() < deadline) {
+      int n = ibv_poll_cq(local_cq_, DEFAULT_CQ_CAPACITY, wc);
+      for (int i = 0; i < n; i++) {
+        delete reinterpret_cast<Context*>(wc[i].wr_id);
+        posted_.fetch_sub(1, std::memory_order_relaxed);
+      }
+    }
+  }
+  wCheckEqual(posted_.load(std::memory_order_acquire), 0U, "destroy a qp with work requests not flushed");
 
   ret = ibv_destroy_qp(local_qp_);
   wCheckEqual(ret, 0, "fail to destroy qp");
 
   ret = rdma_destroy_id(cm_id_);
   wCheckEqual(ret, 0, "fail to destroy cm_id");
+  for (auto ctx : recv_ctxs_) {
+    delete ctx;
+  }
+  delete stream_;
 
-  // warnning! you must ack all events before destroy cq,
-  // otherwise, the func would never end.
-  ret = ibv_destroy_cq(local_cq_);
-  wCheckEqual(ret, 0, "fail to destroy cq");
-  
-  ret = ibv_dereg_mr(buffer_mr_);
-  wCheckEqual(ret, 0, "fail to deregister buffer memory region");
+  // give the cq and buffer back to the device, the pd and mr stay alive
+  device_->releaseCQ(local_cq_, n_cqe_);
+  if (buffer_.addr_ != nullptr) {
+    device_->releaseBuffer(buffer_);
+  }
 
-  ret = ibv_dealloc_pd(local_pd_);
-  wCheckEqual(ret, 0, "fail to deallocate pd");
+  info("clean up connection resources");
+}
 
-  free(buffer_);
+void Connection::flush() {
+  flushed_.store(true, std::memory_order_release);
+  ibv_qp_attr attr{};
+  attr.qp_state = IBV_QPS_ERR;
+  int ret = ibv_modify_qp(local_qp_, &attr, IBV_QP_STATE);
+  wCheckEqual(ret, 0, "ibv_modify_qp() failed to move the qp to error");
+}
 
-  info("clean up connection resources");
+uint32_t Connection::postedNum() {
+  return posted_.load(std::memory_order_acquire);
 }
 
-ibv_qp_init_attr Connection::defaultQpInitAttr() {
+ibv_qp_init_attr Connection::defaultQpInitAttr(const ConnParams& params) {
   ibv_qp_init_attr init_attr;
   init_attr.qp_context = nullptr;
   init_attr.send_cq = nullptr;
   init_attr.recv_cq = nullptr;
   init_attr.srq = nullptr;
   init_attr.cap = ibv_qp_cap {
-    MAX_SEND_WR_NUM,  // max_send_wr
-    MAX_RECV_WR_NUM,  // max_recv_wr
-    1,                // max_send_sge
-    1,                // max_recv_sge
-    0,                // max_inline_data
+    params.recv_slot_num_ + 1 + ATOMIC_SLOT_NUM,  // max_send_wr, a send per slot, one read and the atomics
+    params.recv_slot_num_,                        // max_recv_wr
+    1,                                            // max_send_sge
+    1,                                            // max_recv_sge
+    params.inline_size_,                          // max_inline_data
   };
   init_attr.qp_type = IBV_QPT_RC;
   init_attr.sq_sig_all = 0;
   return init_attr;
 }
 
+uint32_t Connection::cqeNum(const ConnParams& params) {
+  return params.recv_slot_num_ * 2 + 1 + ATOMIC_SLOT_NUM;
+}
+
+size_t Connection::bufferSize(Role role, const ConnParams& params) {
+  // only clients read
+  return params.bufferSize(role == Role::ClientConn);
+}
+
 rdma_conn_param Connection::copyConnParam() {
   return param_;
 }
 
-void Connection::setRkey(uint32_t rkey) {
-  rkey_ = rkey;
+void Connection::setRemoteKV(const KVLayout& layout) {
+  remote_kv_ = layout;
+}
+
+KVLayout Connection::getRemoteKV() {
+  return remote_kv_;
+}
+
+void Connection::setRemoteAtomics(const AtomicLayout& layout) {
+  remote_atomics_ = layout;
+}
+
+AtomicLayout Connection::getRemoteAtomics() {
+  return remote_atomics_;
 }
 
 rdma_cm_id* Connection::getCmId() {
   return cm_id_;
 }
 
+ibv_cq* Connection::getCQ() {
+  return local_cq_;
+}
+
+uint32_t Connection::getQPNum() {
+  return local_qp_->qp_num;
+}
+
 uint32_t Connection::getLKey() {
-  return buffer_mr_->lkey;
+  return buffer_.mr_->lkey;
 }
 
 uint32_t Connection::getRKey() {
-  return buffer_mr_->rkey;
+  return buffer_.mr_->rkey;
 }
 
 void* Connection::getMRAddr() {
-  return buffer_mr_->addr;
+  return buffer_.addr_;
+}
+
+void* Connection::getScratchAddr() {
+  return (char*)buffer_.addr_ + buffer_.size_ - getScratchLen();
+}
+
+uint32_t Connection::getScratchLen() {
+  return role_ == Role::ClientConn && (params_.modes_ & ModeRead) ? READ_SCRATCH_SIZE : 0;
+}
+
+void Connection::setSink(void* sink) {
+  sink_ = sink;
+}
+
+uint32_t Connection::frameSize() {
+  return params_.frameSize();
+}
+
+uint32_t Connection::slotSize() {
+  return params_.slotSize();
+}
+
+void* Connection::recvSlot(uint32_t idx) {
+  assert(idx < params_.recv_slot_num_);
+  return (char*)buffer_.addr_ + idx * slotSize();
+}
+
+void* Connection::sendSlot(uint32_t idx) {
+  assert(idx < params_.recv_slot_num_);
+  return (char*)buffer_.addr_ + (params_.recv_slot_num_ + idx) * slotSize();
+}
+
+uint64_t* Connection::atomicResult(uint32_t slot) {
+  // right behind the send slots, 8-byte aligned as 2 * slotSize() is
+  return reinterpret_cast<uint64_t*>((char*)buffer_.addr_ + 2 * params_.recv_slot_num_ * slotSize()) + slot;
+}
+
+CallTable* Connection::calls() {
+  return &calls_;
+}
+
+void Connection::submit(int slot) {
+  calls_.push(calls_.at(slot));
+  // a thread that loses the post role leaves its call to the holder,
+  // which checks the queue again after giving the role up. The fences
+  // order push before tryLock and unlock before queued, so either the
+  // loser sees the role free or the holder sees the call.
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  while (sendable() && post_lock_.tryLock()) {
+    flushCalls();
+    post_lock_.unlock();
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+  }
+}
+
+bool Connection::sendable() {
+  return calls_.queued() || (held_num_.load(std::memory_order_acquire) > 0 &&
+                             send_inflight_.load(std::memory_order_acquire) < params_.recv_slot_num_);
+}
+
+void* Connection::takeSendSlot() {
+  // a slot is free again once the send that used it has completed
+  if (send_inflight_.load(std::memory_order_acquire) >= params_.recv_slot_num_) {
+    return nullptr;
+  }
+  send_inflight_.fetch_add(1, std::memory_order_relaxed);
+  return sendSlot(next_send_++ % params_.recv_slot_num_);
+}
+
+void Connection::holdFrame(Message* msgs, uint32_t n) {
+  held_msgs_.insert(held_msgs_.end(), msgs, msgs + n);
+  held_frames_.push_back(n);
+  held_num_.store(held_frames_.size(), std::memory_order_release);
+}
+
+void Connection::sendHeld() {
+  if (flushed_.load(std::memory_order_acquire)) {
+    held_msgs_.clear();
+    held_frames_.clear();
+    held_num_.store(0, std::memory_order_release);
+    return;
+  }
+  size_t k = 0;
+  size_t pos = 0;
+  for (void* slot = nullptr; k < held_frames_.size() && (slot = takeSendSlot()) != nullptr; k++) {
+    postFrame(slot, held_msgs_.data() + pos, held_frames_[k]);
+    pos += held_frames_[k];
+  }
+  if (k == 0) {
+    return;
+  }
+  held_msgs_.erase(held_msgs_.begin(), held_msgs_.begin() + pos);
+  held_frames_.erase(held_frames_.begin(), held_frames_.begin() + k);
+  held_num_.store(held_frames_.size(), std::memory_order_release);
+}
+
+void Connection::sendDone() {
+  send_inflight_.fetch_sub(1, std::memory_order_release);
+  if (role_ == Role::ServerConn) {
+    sendHeld();
+    return;
+  }
+  // the poller takes the post role for the held frames only if it is free,
+  // its holder checks them again after giving the role up
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (held_num_.load(std::memory_order_acquire) > 0 && post_lock_.tryLock()) {
+    sendHeld();
+    post_lock_.unlock();
+  }
+}
+
+void Connection::flushCalls() {
+  // every frame carries at least one call, so a frame per call slot at most
+  ibv_sge sges[MAX_RECV_WR_NUM];
+  ibv_send_wr wrs[MAX_RECV_WR_NUM];
+  uint32_t n_frame = 0;
+  Message held[MAX_FRAME_MESSAGE_NUM];
+  sendHeld();
+  PendingCall* call = calls_.takeAll();
+  while (call != nullptr) {
+    // a frame waits for a free slot behind the frames held before it
+    void* slot = held_frames_.empty() ? takeSendSlot() : nullptr;
+    Message* frame = slot != nullptr ? reinterpret_cast<Message*>(slot) : held;
+    uint32_t n = 0;
+    for (; call != nullptr && n < params_.frame_msg_num_; call = call->next_, n++) {
+      frame[n] = call->req_;
+      if (frame[n].traced()) {
+        Tracer::record(ClientPost, getQPNum(), frame[n].reqId());
+      }
+    }
+    if (slot == nullptr) {
+      holdFrame(frame, n);
+      continue;
+    }
+    uint32_t imm = 0;
+    uint32_t len = encodeFrame(frame, n, &imm);
+    sges[n_frame] = ibv_sge{(uint64_t)frame, len, getLKey()};
+    wrs[n_frame] = ibv_send_wr{};
+    wrs[n_frame].wr_id = (uint64_t)(new Context(frame, len));
+    wrs[n_frame].sg_list = &sges[n_frame];
+    wrs[n_frame].num_sge = len > 0 ? 1 : 0;
+    wrs[n_frame].opcode = IBV_WR_SEND_WITH_IMM;
+    wrs[n_frame].send_flags = IBV_SEND_SIGNALED | (len <= params_.inline_size_ ? IBV_SEND_INLINE : 0);
+    wrs[n_frame].imm_data = htonl(imm);
+    if (n_frame > 0) {
+      wrs[n_frame - 1].next = &wrs[n_frame];
+    }
+    n_frame++;
+  }
+  if (n_frame == 0) {
+    return;
+  }
+  // one doorbell for all the frames
+  posted_.fetch_add(n_frame, std::memory_order_relaxed);
+  ibv_send_wr* bad_wr = nullptr;
+  int ret = ibv_post_send(local_qp_, wrs, &bad_wr);
+  checkEqual(ret, 0, "ibv_post_send() failed to post the request frames");
 }
 
+void Connection::sendFrame(Message* msgs, uint32_t n) {
+  assert(n > 0 && n <= params_.frame_msg_num_);
+  if (flushed_.load(std::memory_order_acquire)) {
+    return;  // the peer is gone
+  }
+  // credits, acks and expired answers wait for a slot like any frame
+  void* slot = held_frames_.empty() ? takeSendSlot() : nullptr;
+  if (slot == nullptr) {
+    holdFrame(msgs, n);
+    return;
+  }
+  postFrame(slot, msgs, n);
+}
 
-void Connection::fillMR(void* data, uint32_t size) {
-  assert(size <= buffer_mr_->length);
-  for (int i = 0; i < size; i++)
-  {
-    *((char*)(buffer_mr_->addr) + i) = *((char*)(data) + i);  
+void Connection::postFrame(void* slot, Message* msgs, uint32_t n) {
+  memcpy(slot, msgs, n * sizeof(Message));
+  uint32_t imm = 0;
+  uint32_t len = encodeFrame(slot, n, &imm);
+  postSend(slot, len, getLKey(), len <= params_.inline_size_, imm);
+}
+
+uint32_t Connection::encodeFrame(void* frame, uint32_t n, uint32_t* imm) {
+  Message* msg = reinterpret_cast<Message*>(frame);
+  // a peer that doesn't know compact frames gets full messages
+  if (n == 1 && (params_.modes_ & ModeCompact) && msg->compactable()) {
+    *imm = msg->compactImm();
+    uint32_t len = msg->dataLen();
+    memmove(frame, msg->dataAddr(), len);
+    return len;
   }
+  *imm = 0;
+  return n * sizeof(Message);
+}
+
+Message* Connection::decodeFrame(Context* ctx, const ibv_wc& wc, uint32_t* n) {
+  uint32_t imm = (wc.wc_flags & IBV_WC_WITH_IMM) ? ntohl(wc.imm_data) : 0;
+  *n = 0;
+  if (imm & IMM_COMPACT) {
+    // the payload landed right behind the room for its header
+    if (wc.byte_len > MESSAGE_BUF_SIZE) {
+      info("drop a compact frame of %u bytes", wc.byte_len);
+      return nullptr;
+    }
+    Message* msg = reinterpret_cast<Message*>((char*)ctx->addr() - sizeof(Header));
+    msg->fromCompact(imm, wc.byte_len);
+    *n = 1;
+    return msg;
+  }
+  // the lengths come from the peer, nothing is read past a message
+  uint32_t n_msg = wc.byte_len / sizeof(Message);
+  Message* msgs = reinterpret_cast<Message*>(ctx->addr());
+  if (n_msg == 0 || n_msg > params_.frame_msg_num_) {
+    info("drop a frame of %u messages", n_msg);
+    return nullptr;
+  }
+  for (uint32_t i = 0; i < n_msg; i++) {
+    if (msgs[i].dataLen() > MESSAGE_BUF_SIZE) {
+      info("drop a frame with a message of %u bytes", msgs[i].dataLen());
+      return nullptr;
+    }
+  }
+  *n = n_msg;
+  return msgs;
 }
 
 void Connection::prepare() {
-  postRecv(buffer_mr_->addr, buffer_mr_->length, buffer_mr_->lkey);
+  for (uint32_t i = 0; i < params_.recv_slot_num_; i++) {
+    postRecv((char*)recvSlot(i) + sizeof(Header), frameSize(), getLKey());
+  }
   switch (role_) {
   case Role::ServerConn : {
     state_ = State::WaitingForRequest;
@@ -160,6 +482,13 @@ void Connection::prepare() {
   }
 }
 
+void Connection::repostRecv(Context* ctx) {
+  if (not flushed_.load(std::memory_order_acquire)) {
+    postRecv(ctx->addr(), frameSize(), getLKey());
+  }
+  delete ctx;
+}
+
 void Connection::poll() {
   static ibv_wc wc[DEFAULT_CQ_CAPACITY];
   int ret = ibv_poll_cq(local_cq_, DEFAULT_CQ_CAPACITY, wc);
@@ -172,40 +501,80 @@ void Connection::poll() {
   }
 
   for (int i = 0; i < ret; i++) {
-    switch (role_){
-    case Role::ServerConn: {
-      serverAdvance(wc[i]);
-      break;
-    }
-    case Role::ClientConn: {
-      clientAdvance(wc[i]);
-      break;
-    }
+    advance(wc[i]);
+  }
+}
+
+void Connection::advance(const ibv_wc &wc) {
+  posted_.fetch_sub(1, std::memory_order_release);
+  if (wc.status != IBV_WC_SUCCESS) {
+    // opcode is undefined in a failed wc, release the waiting client anyway
+    info("work completion failed: %s", ibv_wc_status_str(wc.status));
+    delete reinterpret_cast<Context*>(wc.wr_id);
+    if (role_ == Role::ClientConn) {
+      state_ = Vacant;
+      abortCalls();
+      // only the failed read holds the lock
+      if (wc.wr_id == read_wr_.load(std::memory_order_acquire)) {
+        read_wr_.store(0, std::memory_order_relaxed);
+        sink_ = nullptr;
+        unlock();
+      }
     }
+    return;
+  }
+  switch (role_){
+  case Role::ServerConn: {
+    serverAdvance(wc);
+    break;
+  }
+  case Role::ClientConn: {
+    clientAdvance(wc);
+    break;
+  }
+  default: {
+    break;
+  }
   }
 }
 
 void Connection::serverAdvance(const ibv_wc &wc) {
   switch (wc.opcode) {
   case IBV_WC_RECV: {
-    assert(state_ == WaitingForRequest);
     Context* ctx = reinterpret_cast<Context*>(wc.wr_id);
-    Message* req = reinterpret_cast<Message*>(ctx->addr());
+    uint32_t n = 0;
+    Message* msgs = decodeFrame(ctx, wc, &n);
+    if (n == 0) {
+      repostRecv(ctx);
+      break;
+    }
+    if (n == 1 && msgs[0].msgType() == Credit) {
+      uint32_t credits = 0;
+      memcpy(&credits, msgs[0].dataAddr(), sizeof(credits));
+      credits_ += credits;
+      repostRecv(ctx);
+      break;
+    }
+    // the poller collects them into a batch for the handler
+    recv_ctxs_.push_back(ctx);
+    for (uint32_t i = 0; i < n; i++) {
+      pending_reqs_.push_back(&msgs[i]);
+      budgets_.push_back(msgs[i].budgetUs() * 1000ULL);
+      if (msgs[i].budgetUs() != 0) {
+        deadline_num_++;
+      }
+      if (msgs[i].traced()) {
+        Tracer::record(ServerRecv, getQPNum(), msgs[i].reqId());
+      }
+    }
     state_ = HandlingRequest;
-    info("recive from client, start handling the request");
-    Message resp = handler_.handlerRequest(req);
-    info("handle over");
-    // send resp
-    fillMR((void*)&resp, sizeof(resp));
-    postSend(getMRAddr(), sizeof(resp), getLKey(), false);
-    delete ctx;
+    info("recive %u requests from client, wait for handling them", n);
     break;
   }
   case IBV_WC_SEND: {
-    assert(state_ == HandlingRequest);
-    prepare();
-    info("response send completed, waiting for next request");
-    state_ = WaitingForRequest;
+    delete reinterpret_cast<Context*>(wc.wr_id);
+    sendDone();
+    info("response send completed");
     break;
   }
   case IBV_WC_RDMA_READ: {
@@ -224,28 +593,251 @@ void Connection::serverAdvance(const ibv_wc &wc) {
 }
 
 
+std::vector<Message*>& Connection::pendingRequests() {
+  return pending_reqs_;
+}
+
+uint32_t Connection::pendingFrameNum() {
+  return recv_ctxs_.size();
+}
+
+bool Connection::hasDeadlines() {
+  return deadline_num_ != 0;
+}
+
+uint32_t Connection::dropExpired(uint64_t now_ns, uint64_t since_ns) {
+  Message expired[MAX_FRAME_MESSAGE_NUM];
+  uint32_t n_expired = 0;
+  uint32_t n_dropped = 0;
+  uint32_t m = 0;
+  for (uint32_t i = 0; i < pending_reqs_.size(); i++) {
+    Message* req = pending_reqs_[i];
+    if (budgets_[i] == 0 || since_ns + budgets_[i] > now_ns) {
+      pending_reqs_[m] = req;
+      budgets_[m] = budgets_[i];
+      m++;
+      continue;
+    }
+    deadline_num_--;
+    n_dropped++;
+    if (req->msgType() == OneWay) {
+      expired_acked_ |= req->slot() < 64 ? 1ULL << req->slot() : 0;
+      continue;
+    }
+    // the answer frees the call slot, the caller may have given up already
+    char none = 0;
+    expired[n_expired] = Message(&none, 0, Expired);
+    expired[n_expired].setSlot(req->slot());
+    expired[n_expired].setTrace(req->reqId(), req->traced());
+    if (++n_expired == params_.frame_msg_num_) {
+      sendFrame(expired, n_expired);
+      n_expired = 0;
+    }
+  }
+  if (n_expired != 0) {
+    sendFrame(expired, n_expired);
+  }
+  pending_reqs_.resize(m);
+  budgets_.resize(m);
+  return n_dropped;
+}
+
+void Connection::respond(Message** reqs, Message* resps, uint32_t n) {
+  // one-way requests get no response, a single ack frees all their call slots
+  uint64_t acked = expired_acked_;
+  uint32_t m = 0;
+  for (uint32_t i = 0; i < n; i++) {
+    if (reqs[i]->msgType() == OneWay) {
+      acked |= reqs[i]->slot() < 64 ? 1ULL << reqs[i]->slot() : 0;
+      continue;
+    }
+    if (m != i) {
+      resps[m] = resps[i];
+    }
+    resps[m].setSlot(reqs[i]->slot());
+    resps[m].setTrace(reqs[i]->reqId(), reqs[i]->traced());
+    m++;
+  }
+  // the room of a dropped response, the ack rides in the last frame,
+  // it goes alone if only expired requests were one-way
+  if (acked != 0) {
+    Message ack((char*)&acked, sizeof(acked), Ack);
+    if (m < n) {
+      resps[m++] = ack;
+    } else {
+      sendFrame(&ack, 1);
+    }
+  }
+  expired_acked_ = 0;
+  n = m;
+  uint32_t frame_msg_num = params_.frame_msg_num_;
+  for (uint32_t i = 0; i < n; i += frame_msg_num) {
+    sendFrame(resps + i, std::min(n - i, frame_msg_num));
+  }
+  for (uint32_t i = 0; i < n; i++) {
+    if (resps[i].traced()) {
+      Tracer::record(ServerRespPost, getQPNum(), resps[i].reqId());
+    }
+  }
+  // the requests are consumed, their slots take the next frames
+  for (auto ctx : recv_ctxs_) {
+    repostRecv(ctx);
+  }
+  recv_ctxs_.clear();
+  pending_reqs_.clear();
+  budgets_.clear();
+  deadline_num_ = 0;
+  if (stream_ == nullptr) {
+    state_ = WaitingForRequest;
+  }
+}
+
+void Connection::startStream(Message* req, Stream* stream) {
+  assert(stream_ == nullptr);
+  stream_ = stream;
+  stream_slot_ = req->slot();
+  stream_req_id_ = req->reqId();
+  stream_traced_ = req->traced();
+}
+
+bool Connection::streaming() {
+  return stream_ != nullptr;
+}
+
+bool Connection::pumpStream() {
+  while (stream_ != nullptr && credits_ > 0 && send_inflight_.load(std::memory_order_relaxed) < params_.recv_slot_num_) {
+    Message chunk;
+    bool more = stream_->next(&chunk);
+    if (not more) {
+      // an empty response ends the stream, it lands in the recv slot kept by the call
+      char none = 0;
+      chunk = Message(&none, 0, Response);
+    }
+    chunk.setSlot(stream_slot_);
+    chunk.setTrace(stream_req_id_, stream_traced_);
+    sendFrame(&chunk, 1);
+    if (more) {
+      credits_--;
+      continue;
+    }
+    if (stream_traced_) {
+      Tracer::record(ServerRespPost, getQPNum(), stream_req_id_);
+    }
+    delete stream_;
+    stream_ = nullptr;
+    state_ = WaitingForRequest;
+  }
+  return stream_ != nullptr;
+}
+
 void Connection::clientAdvance(const ibv_wc &wc) {
   switch (wc.opcode) {
   case IBV_WC_SEND: {
     Context* ctx = reinterpret_cast<Context*>(wc.wr_id);
+    Message* msgs = reinterpret_cast<Message*>(ctx->addr());
+    // compact sends are never traced, and shorter than one message
+    for (uint32_t i = 0; i < ctx->length() / sizeof(Message); i++) {
+      if (msgs[i].traced()) {
+        Tracer::record(ClientSendDone, getQPNum(), msgs[i].reqId());
+      }
+    }
     delete ctx;
+    sendDone();
     state_ = WaitingForResponse;
     info("request send completed, waiting for response");
     break;
   }
   case IBV_WC_RECV: {
-    prepare();
-    assert(state_ == WaitingForResponse);
     Context* ctx = reinterpret_cast<Context*>(wc.wr_id);
-    Message* resp = reinterpret_cast<Message*>(ctx->addr());
-    if(resp->msgType() == Response) {
+    uint32_t n = 0;
+    Message* msgs = decodeFrame(ctx, wc, &n);
+    PendingCall* answered[MAX_FRAME_MESSAGE_NUM];
+    uint32_t n_answered = 0;
+    uint64_t acked = 0;
+    bool stream_end = false;
+    for (uint32_t i = 0; i < n; i++) {
+      Message* resp = &msgs[i];
+      if (resp->msgType() == Ack) {
+        uint64_t slots = 0;
+        memcpy(&slots, resp->dataAddr(), sizeof(slots));
+        acked |= slots;
+        continue;
+      }
+      if (resp->slot() >= calls_.size()) {
+        info("response of unknown call slot %u", resp->slot());
+        continue;
+      }
+      PendingCall* call = calls_.at(resp->slot());
+      if (resp->msgType() == StreamChunk) {
+        if (call->on_chunk_) {
+          call->on_chunk_(resp->dataAddr(), resp->dataLen());
+        }
+        consumed_++;
+        continue;
+      }
+      if (resp->msgType() != Response && resp->msgType() != Expired) {
+        continue;
+      }
       info("receive response from server, resp data is: %s", resp->dataAddr());
-      state_ = Vacant;
-      unlock();
+      if (resp->traced()) {
+        Tracer::record(ClientRecv, getQPNum(), resp->reqId());
+      }
+      if (call->on_chunk_) {
+        call->on_chunk_ = nullptr;
+        stream_end = true;
+      }
+      // nobody waits any more, the caller has given up or never waited
+      if (call->detached_.exchange(true)) {
+        acked |= 1ULL << resp->slot();
+        continue;
+      }
+      if (call->resp_ != nullptr) {
+        *call->resp_ = *resp;
+      }
+      answered[n_answered++] = call;
+    }
+    // the slot is posted again before the callers may send more
+    repostRecv(ctx);
+    // give the window back to the server, so it keeps streaming
+    if (consumed_ >= std::max(1U, params_.streamWindow() / 2) || (stream_end && consumed_ > 0)) {
+      returnCredits();
+    }
+    // one-way and abandoned calls, nobody waits for them
+    for (; acked != 0; acked &= acked - 1) {
+      uint32_t slot = __builtin_ctzll(acked);
+      if (slot < calls_.size() && calls_.inFlight(slot)) {
+        calls_.release(slot);
+      }
+    }
+    for (uint32_t i = 0; i < n_answered; i++) {
+      answered[i]->done_.store(true, std::memory_order_release);
     }
+    state_ = Vacant;
     break;
   }
   case IBV_WC_RDMA_READ: {
+    Context* ctx = reinterpret_cast<Context*>(wc.wr_id);
+    if (sink_ != nullptr) {
+      memcpy(sink_, ctx->addr(), ctx->length());
+      sink_ = nullptr;
+    }
+    delete ctx;
+    state_ = Vacant;
+    read_wr_.store(0, std::memory_order_relaxed);
+    unlock();
+    break;
+  }
+  case IBV_WC_FETCH_ADD:
+  case IBV_WC_COMP_SWAP: {
+    Context* ctx = reinterpret_cast<Context*>(wc.wr_id);
+    uint64_t* result = reinterpret_cast<uint64_t*>(ctx->addr());
+    AtomicOp* op = &atomic_ops_[result - atomicResult(0)];
+    if (op->old_ != nullptr) {
+      *op->old_ = *result;
+    }
+    op->ok_ = true;
+    op->done_.store(true, std::memory_order_release);
+    delete ctx;
     break;
   }
   case IBV_WC_RDMA_WRITE: {
@@ -258,7 +850,35 @@ void Connection::clientAdvance(const ibv_wc &wc) {
   }
 }
 
-void Connection::postSend(void* local_addr, uint32_t length, uint32_t lkey, bool need_inline){
+void Connection::returnCredits() {
+  Message credit((char*)&consumed_, sizeof(consumed_), Credit);
+  consumed_ = 0;
+  std::lock_guard<Spinlock> lock(post_lock_);
+  sendFrame(&credit, 1);
+}
+
+void Connection::abortCalls() {
+  for (uint32_t slot = 0; slot < calls_.size(); slot++) {
+    PendingCall* call = calls_.at(slot);
+    if (calls_.inFlight(slot) && not call->done_.load(std::memory_order_acquire)) {
+      call->on_chunk_ = nullptr;
+      if (call->detached_.exchange(true)) {
+        calls_.release(slot);
+      } else {
+        call->done_.store(true, std::memory_order_release);
+      }
+    }
+  }
+  uint32_t free = atomic_free_.load(std::memory_order_acquire);
+  for (uint32_t slot = 0; slot < ATOMIC_SLOT_NUM; slot++) {
+    if (not (free & (1U << slot)) && not atomic_ops_[slot].done_.load(std::memory_order_acquire)) {
+      atomic_ops_[slot].ok_ = false;
+      atomic_ops_[slot].done_.store(true, std::memory_order_release);
+    }
+  }
+}
+
+void Connection::postSend(void* local_addr, uint32_t length, uint32_t lkey, bool need_inline, uint32_t imm){
   ibv_sge sge {
     (uint64_t) local_addr, // addr
     length,                // length
@@ -268,14 +888,15 @@ void Connection::postSend(void* local_addr, uint32_t length, uint32_t lkey, bool
     (uint64_t)(new Context(local_addr, length)),           // wr_id
     nullptr,               // next
     &sge,                  // sg_list
-    1,                     // num_sge
-    IBV_WR_SEND,           // opcode
+    length > 0 ? 1 : 0,    // num_sge
+    IBV_WR_SEND_WITH_IMM,  // opcode
     IBV_SEND_SIGNALED,     // send_flags
     {},
     {},
     {},
     {},
   };
+  wr.imm_data = htonl(imm);
 
   if (need_inline) {
     wr.send_flags |= IBV_SEND_INLINE;
@@ -283,11 +904,108 @@ void Connection::postSend(void* local_addr, uint32_t length, uint32_t lkey, bool
 
   ibv_send_wr* bad_wr = nullptr;
 
+  posted_.fetch_add(1, std::memory_order_relaxed);
   int ret = ibv_post_send(local_qp_, &wr, &bad_wr);
   checkEqual(ret, 0, "ibv_post_send() failed");
 }
 
 
+void Connection::postRead(void* local_addr, uint32_t length, uint32_t lkey, uint64_t remote_addr, uint32_t rkey) {
+  ibv_sge sge {
+    (uint64_t) local_addr, // addr
+    length,                // length
+    lkey,                  // lkey
+  };
+  ibv_send_wr wr {
+    (uint64_t)(new Context(local_addr, length)),           // wr_id
+    nullptr,               // next
+    &sge,                  // sg_list
+    1,                     // num_sge
+    IBV_WR_RDMA_READ,      // opcode
+    IBV_SEND_SIGNALED,     // send_flags
+    {},
+    {},
+    {},
+    {},
+  };
+  wr.wr.rdma.remote_addr = remote_addr;
+  wr.wr.rdma.rkey = rkey;
+  read_wr_.store(wr.wr_id, std::memory_order_release);
+
+  ibv_send_wr* bad_wr = nullptr;
+  posted_.fetch_add(1, std::memory_order_relaxed);
+  int ret = ibv_post_send(local_qp_, &wr, &bad_wr);
+  checkEqual(ret, 0, "ibv_post_send() failed to post rdma read");
+}
+
+int Connection::postAtomic(ibv_wr_opcode opcode, uint32_t idx, uint64_t compare_add, uint64_t swap, uint64_t* old) {
+  if (idx >= remote_atomics_.word_num_) {
+    return -1;
+  }
+  uint32_t free = atomic_free_.load(std::memory_order_relaxed);
+  int slot = -1;
+  while (free != 0) {
+    int candidate = __builtin_ctz(free);
+    if (atomic_free_.compare_exchange_weak(free, free & ~(1U << candidate), std::memory_order_acquire)) {
+      slot = candidate;
+      break;
+    }
+  }
+  if (slot < 0) {
+    return -1;
+  }
+  AtomicOp* op = &atomic_ops_[slot];
+  op->old_ = old;
+  op->ok_ = false;
+  op->done_.store(false, std::memory_order_relaxed);
+
+  uint64_t* result = atomicResult(slot);
+  ibv_sge sge {
+    (uint64_t) result,     // addr
+    sizeof(uint64_t),      // length
+    getLKey(),             // lkey
+  };
+  ibv_send_wr wr {
+    (uint64_t)(new Context(result, sizeof(uint64_t))),     // wr_id
+    nullptr,               // next
+    &sge,                  // sg_list
+    1,                     // num_sge
+    opcode,                // opcode
+    IBV_SEND_SIGNALED,     // send_flags
+    {},
+    {},
+    {},
+    {},
+  };
+  wr.wr.atomic.remote_addr = remote_atomics_.addr_ + static_cast<uint64_t>(idx) * sizeof(uint64_t);
+  wr.wr.atomic.rkey = remote_atomics_.rkey_;
+  wr.wr.atomic.compare_add = compare_add;
+  wr.wr.atomic.swap = swap;
+
+  ibv_send_wr* bad_wr = nullptr;
+  posted_.fetch_add(1, std::memory_order_relaxed);
+  int ret = ibv_post_send(local_qp_, &wr, &bad_wr);
+  checkEqual(ret, 0, "ibv_post_send() failed to post atomic");
+  return slot;
+}
+
+bool Connection::atomicDone(int id, bool* ok) {
+  // -1 of a failed post, or a slot already released, is never done
+  if (id < 0 || id >= static_cast<int>(ATOMIC_SLOT_NUM) ||
+      (atomic_free_.load(std::memory_order_acquire) & (1U << id))) {
+    return false;
+  }
+  AtomicOp* op = &atomic_ops_[id];
+  if (not op->done_.load(std::memory_order_acquire)) {
+    return false;
+  }
+  if (ok != nullptr) {
+    *ok = op->ok_;
+  }
+  atomic_free_.fetch_or(1U << id, std::memory_order_release);
+  return true;
+}
+
 void Connection::postRecv(void* local_addr, uint32_t length, uint32_t lkey) {
   ibv_sge sge {
     (uint64_t) local_addr, // addr
@@ -304,6 +1022,7 @@ void Connection::postRecv(void* local_addr, uint32_t length, uint32_t lkey) {
   //std::cout << "postRecv local_addr: " << local_addr << std::endl;
 
   ibv_recv_wr* bad_wr = nullptr;
+  posted_.fetch_add(1, std::memory_order_relaxed);
   int ret = ibv_post_recv(local_qp_, &wr, &bad_wr);
   checkEqual(ret, 0, "ibv_post_recv() failed");
 }
@@ -0,0 +1,166 @@
+#include <device.h>
+#include <placement.h>
+#include <util.h>
+#include <const.h>
+#include <stdlib.h>
+#include <mutex>
+#include <algorithm>
+
+static Spinlock devices_lock;
+static std::map<ibv_context*, Device*> devices;
+
+Device* Device::get(ibv_context* verbs) {
+  std::lock_guard<Spinlock> lock(devices_lock);
+  auto it = devices.find(verbs);
+  if (it != devices.end()) {
+    return it->second;
+  }
+  Device* device = new Device(verbs);
+  devices.emplace(verbs, device);
+  return device;
+}
+
+Device::Device(ibv_context* verbs)
+    : verbs_(verbs),
+      node_(Placement::deviceNode(verbs)) {
+  pd_ = ibv_alloc_pd(verbs_);
+  checkNotEqual(pd_, static_cast<ibv_pd*>(nullptr), "ibv_alloc_pd() failed, pd_ == nullptr");
+  info("open device %s, numa node %d", ibv_get_device_name(verbs_->device), node_);
+}
+
+ibv_context* Device::verbs() {
+  return verbs_;
+}
+
+ibv_pd* Device::pd() {
+  return pd_;
+}
+
+int Device::node() {
+  return node_;
+}
+
+ibv_cq* Device::acquireCQ(uint32_t n_cqe, bool shared, uint32_t group) {
+  std::lock_guard<Spinlock> lock(lock_);
+  for (auto& slot : cqs_) {
+    if (slot.shared_ != shared || slot.group_ != group || slot.used_ + n_cqe > slot.capacity_) {
+      continue;
+    }
+    if (not shared && slot.used_ != 0) {
+      continue;
+    }
+    slot.used_ += n_cqe;
+    return slot.cq_;
+  }
+  ibv_cq* cq = createCQ(n_cqe, shared, group);
+  cqs_.back().used_ = n_cqe;
+  return cq;
+}
+
+ibv_cq* Device::createCQ(uint32_t n_cqe, bool shared, uint32_t group) {
+  CQSlot slot;
+  slot.capacity_ = shared ? std::max(DEVICE_CQ_CAPACITY, n_cqe) : std::max(DEFAULT_CQ_CAPACITY, n_cqe);
+  slot.shared_ = shared;
+  slot.group_ = group;
+  NodeScope scope(node_);
+  slot.cq_ = ibv_create_cq(verbs_, slot.capacity_, nullptr, nullptr, 0);
+  checkNotEqual(slot.cq_, static_cast<ibv_cq*>(nullptr), "ibv_create_cq() failed, cq == nullptr");
+  cqs_.push_back(slot);
+  info("create %s completion queue(cq), capacity is %u", shared ? "shared" : "exclusive", slot.capacity_);
+  return slot.cq_;
+}
+
+void Device::releaseCQ(ibv_cq* cq, uint32_t n_cqe) {
+  std::lock_guard<Spinlock> lock(lock_);
+  for (auto& slot : cqs_) {
+    if (slot.cq_ == cq) {
+      slot.used_ -= std::min(slot.used_, n_cqe);
+      // the next qp must not see completions of the last one
+      if (not slot.shared_) {
+        ibv_wc wc[DEFAULT_CQ_CAPACITY];
+        int left = 0;
+        for (int n = 0; (n = ibv_poll_cq(cq, DEFAULT_CQ_CAPACITY, wc)) > 0;) {
+          left += n;
+        }
+        wCheckEqual(left, 0, "release a cq with completions left");
+      }
+      return;
+    }
+  }
+}
+
+Buffer Device::acquireBuffer(size_t size) {
+  std::lock_guard<Spinlock> lock(lock_);
+  auto& free_list = free_buffers_[size];
+  if (free_list.empty()) {
+    growBuffers(size, std::max<size_t>(1, created_[size]));
+  }
+  Buffer buffer = free_list.back();
+  free_list.pop_back();
+  return buffer;
+}
+
+void Device::releaseBuffer(Buffer buffer) {
+  std::lock_guard<Spinlock> lock(lock_);
+  free_buffers_[buffer.size_].push_back(buffer);
+}
+
+void Device::reserve(uint32_t n_conn, uint32_t n_cqe, bool shared, size_t buffer_size, uint32_t group) {
+  std::lock_guard<Spinlock> lock(lock_);
+  auto& free_list = free_buffers_[buffer_size];
+  while (free_list.size() < n_conn) {
+    growBuffers(buffer_size, n_conn - free_list.size());
+  }
+
+  uint32_t room = 0;
+  for (auto& slot : cqs_) {
+    if (slot.shared_ == shared && slot.group_ == group) {
+      room += shared ? (slot.capacity_ - slot.used_) / n_cqe : (slot.used_ == 0);
+    }
+  }
+  for (; room < n_conn; room += shared ? DEVICE_CQ_CAPACITY / n_cqe : 1) {
+    createCQ(n_cqe, shared, group);
+  }
+}
+
+// grow the pool by a slab, one registration covers the whole slab, so
+// it is local only: a remote key would open the buffers of other peers
+void Device::growBuffers(size_t size, uint32_t n) {
+  n = std::min(MAX_BUFFER_SLAB_NUM, n);
+  size_t slab_size = n * size;
+  NodeScope scope(node_);
+  void* slab = aligned_alloc(4096, (slab_size + 4095) / 4096 * 4096);
+  checkNotEqual(slab, static_cast<void*>(nullptr), "aligned_alloc() failed to alloc buffer slab");
+  int access = IBV_ACCESS_LOCAL_WRITE;
+  ibv_mr* mr = ibv_reg_mr(pd_, slab, slab_size, access);
+  checkNotEqual(mr, static_cast<ibv_mr*>(nullptr), "ibv_reg_mr() falied to register buffer slab");
+  auto& free_list = free_buffers_[size];
+  for (uint32_t i = 0; i < n; i++) {
+    free_list.push_back(Buffer{static_cast<char*>(slab) + i * size, size, mr});
+  }
+  created_[size] += n;
+  info("create memory region(mr), %u buffers of %zu bytes", n, size);
+}
+
+ibv_mr* Device::registerMemory(void* addr, size_t len, int access) {
+  std::lock_guard<Spinlock> lock(lock_);
+  auto it = mrs_.find(addr);
+  if (it != mrs_.end()) {
+    return it->second;
+  }
+  ibv_mr* mr = ibv_reg_mr(pd_, addr, len, access);
+  checkNotEqual(mr, static_cast<ibv_mr*>(nullptr), "ibv_reg_mr() failed to register memory");
+  mrs_.emplace(addr, mr);
+  return mr;
+}
+
+void Device::deregisterMemory(void* addr) {
+  std::lock_guard<Spinlock> lock(lock_);
+  auto it = mrs_.find(addr);
+  if (it == mrs_.end()) {
+    return;
+  }
+  int ret = ibv_dereg_mr(it->second);
+  wCheckEqual(ret, 0, "fail to deregister memory region");
+  mrs_.erase(it);
+}
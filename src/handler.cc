@@ -4,6 +4,7 @@
 #include <util.h>
 #include <algorithm>
 #include <assert.h>
+#include <sort_kernel.h>
 
 Handler::Handler(){
 
@@ -13,11 +14,121 @@ Handler::~Handler(){
 
 }
 
-Message Handler::handlerRequest(Message* req) {
-  assert(req->msgType() == ImmRequest || req->msgType() == Request);
-  char data[req->dataLen()];
-  memcpy(data, req->dataAddr(), req->dataLen());
-  std::sort(data, data + sizeof(data));
-  Message resp(data, sizeof(data), Response);
+void Handler::setKVTable(KVTable* kv_table) {
+  kv_table_ = kv_table;
+}
+
+Message Handler::handlerRequest(Message* req, RequestContext* /*ctx*/) {
+  assert(req->msgType() == ImmRequest || req->msgType() == Request || req->msgType() == OneWay);
+  switch (req->method()) {
+  case Method::KVGet: {
+    return handleKVGet(req);
+  }
+  case Method::KVPut: {
+    return handleKVPut(req);
+  }
+  case Method::KVScan: {
+    // streams are opened by the poller, one per connection at a time
+    char none = 0;
+    return Message(&none, 0, Response, req->method());
+  }
+  default: {
+    return handleSort(req);
+  }
+  }
+}
+
+void Handler::handlerBatch(Message** reqs, Message* resps, uint32_t n, RequestContext* ctx) {
+  // sorts are the common case, run them back to back first, the others
+  // are collected in scratch memory and follow
+  uint32_t* rest = ctx->arena_->allocArray<uint32_t>(n);
+  uint32_t n_rest = 0;
+  for (uint32_t i = 0; i < n; i++) {
+    if (reqs[i]->method() == Method::SortBytes) {
+      resps[i] = handlerRequest(reqs[i], ctx);
+    } else {
+      rest[n_rest++] = i;
+    }
+  }
+  for (uint32_t k = 0; k < n_rest; k++) {
+    resps[rest[k]] = handlerRequest(reqs[rest[k]], ctx);
+  }
+}
+
+Message Handler::handleSort(Message* req) {
+  uint32_t len = std::min<uint32_t>(req->dataLen(), MESSAGE_BUF_SIZE);
+  Message resp(req->dataAddr(), len, Response);
+  sortBytes(resp.dataAddr(), len);
   return resp;
-}
\ No newline at end of file
+}
+
+// req: key, resp: [found(1B)][value]
+Message Handler::handleKVGet(Message* req) {
+  // the value is copied straight into the buffer, no string per lookup
+  char data[MESSAGE_BUF_SIZE];
+  uint32_t len = 0;
+  data[0] = kv_table_ != nullptr && kv_table_->get(req->dataAddr(), req->dataLen(), data + 1, MESSAGE_BUF_SIZE - 1, &len);
+  return Message(data, len + 1, Response, Method::KVGet);
+}
+
+// req: [key_len(1B)][key][value], resp: [ok(1B)]
+Message Handler::handleKVPut(Message* req) {
+  char ok = 0;
+  uint32_t key_len = static_cast<uint8_t>(req->dataAddr()[0]);
+  if (kv_table_ != nullptr && req->dataLen() > 0 && key_len + 1 <= req->dataLen()) {
+    kv_table_->put(req->dataAddr() + 1, key_len,
+                   req->dataAddr() + 1 + key_len, req->dataLen() - 1 - key_len);
+    ok = 1;
+  }
+  return Message(&ok, 1, Response, Method::KVPut);
+}
+
+// chunk: [key_len(1B)][value_len(1B)][key][value]..., as many pairs as fit
+class KVScanStream : public Stream {
+public:
+  explicit KVScanStream(KVTable* kv_table) : kv_table_(kv_table) {}
+
+  bool next(Message* chunk) override {
+    char data[MESSAGE_BUF_SIZE];
+    uint32_t len = 0;
+    while (kv_table_ != nullptr) {
+      if (not held_ && not kv_table_->scan(&cursor_, &key_, &value_)) {
+        break;
+      }
+      // a pair is never split, long values of the overflow map are cut
+      uint32_t key_len = std::min<uint32_t>(key_.size(), MESSAGE_BUF_SIZE - 2);
+      uint32_t value_len = std::min<uint32_t>(value_.size(), MESSAGE_BUF_SIZE - 2 - key_len);
+      if (len + 2 + key_len + value_len > MESSAGE_BUF_SIZE) {
+        held_ = true;
+        break;
+      }
+      data[len] = static_cast<char>(key_len);
+      data[len + 1] = static_cast<char>(value_len);
+      memcpy(data + len + 2, key_.data(), key_len);
+      memcpy(data + len + 2 + key_len, value_.data(), value_len);
+      len += 2 + key_len + value_len;
+      held_ = false;
+    }
+    if (len == 0) {
+      return false;
+    }
+    *chunk = Message(data, len, StreamChunk, Method::KVScan);
+    return true;
+  }
+
+private:
+  KVTable* kv_table_;
+  KVCursor cursor_{};
+  std::string key_;
+  std::string value_;
+  bool held_{false};  // key_ and value_ didn't fit into the last chunk
+};
+
+bool Handler::isStreaming(Method method) {
+  return method == Method::KVScan;
+}
+
+Stream* Handler::openStream(Message* req) {
+  assert(isStreaming(req->method()));
+  return new KVScanStream(kv_table_);
+}
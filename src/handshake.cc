@@ -0,0 +1,117 @@
+#include <handshake.h>
+#include <message.h>
+#include <string.h>
+#include <algorithm>
+
+// appended fields must still fit the private data of rdma_connect()
+static_assert(sizeof(HANDSHAKE_VERSION) + sizeof(SectionHeader) + sizeof(ConnParams) <= CONNECT_DATA_SIZE,
+              "the params outgrow the private data of rdma_connect()");
+
+ConnParams ConnParams::limits() {
+  ConnParams params;
+  params.frame_msg_num_ = MAX_FRAME_MESSAGE_NUM;
+  params.recv_slot_num_ = MAX_RECV_WR_NUM;
+  return params;
+}
+
+ConnParams ConnParams::negotiate(const ConnParams& peer) const {
+  ConnParams agreed;
+  agreed.frame_msg_num_ = std::max<uint32_t>(1, std::min({frame_msg_num_, peer.frame_msg_num_,
+                                                          static_cast<uint16_t>(MAX_FRAME_MESSAGE_NUM)}));
+  agreed.max_msg_size_ = std::min({max_msg_size_, peer.max_msg_size_, MESSAGE_BUF_SIZE});
+  agreed.recv_slot_num_ = std::max(MIN_RECV_SLOT_NUM, std::min({recv_slot_num_, peer.recv_slot_num_, MAX_RECV_WR_NUM}));
+  agreed.inline_size_ = std::min({inline_size_, peer.inline_size_, MAX_INLINE_SIZE});
+  agreed.modes_ = modes_ & peer.modes_ & ModeAll;
+  agreed.priority_ = std::min(std::max({priority_, peer.priority_}), PRIORITY_CLASS_NUM - 1);
+  return agreed;
+}
+
+uint32_t ConnParams::callSlotNum() const {
+  return recv_slot_num_ - streamWindow();
+}
+
+uint32_t ConnParams::streamWindow() const {
+  return (modes_ & ModeStream) ? recv_slot_num_ / 2 : 0;
+}
+
+uint32_t ConnParams::frameSize() const {
+  return frame_msg_num_ * sizeof(Message);
+}
+
+uint32_t ConnParams::slotSize() const {
+  return sizeof(Header) + frameSize();
+}
+
+size_t ConnParams::bufferSize(bool client) const {
+  size_t size = static_cast<size_t>(recv_slot_num_) * 2 * slotSize();
+  if (client && (modes_ & ModeAtomic)) {
+    size += ATOMIC_SLOT_NUM * sizeof(uint64_t);
+  }
+  if (client && (modes_ & ModeRead)) {
+    size += READ_SCRATCH_SIZE;
+  }
+  // whole pages, so that the pool has few distinct sizes
+  return (size + 4095) / 4096 * 4096;
+}
+
+
+/* HandshakeWriter */
+HandshakeWriter::HandshakeWriter() {
+  uint16_t version = HANDSHAKE_VERSION;
+  memcpy(buf_, &version, sizeof(version));
+  size_ = sizeof(version);
+}
+
+bool HandshakeWriter::add(HandshakeSection type, const void* data, uint16_t len, uint32_t capacity) {
+  if (size_ + sizeof(SectionHeader) + len > std::min<uint32_t>(capacity, sizeof(buf_))) {
+    return false;
+  }
+  SectionHeader header{type, len};
+  memcpy(buf_ + size_, &header, sizeof(header));
+  memcpy(buf_ + size_ + sizeof(header), data, len);
+  size_ += sizeof(header) + len;
+  return true;
+}
+
+const void* HandshakeWriter::data() {
+  return buf_;
+}
+
+uint32_t HandshakeWriter::size() {
+  return size_;
+}
+
+
+/* HandshakeReader */
+HandshakeReader::HandshakeReader(const void* data, uint32_t len)
+    : data_(static_cast<const char*>(data)), len_(data == nullptr ? 0 : len) {
+  if (len_ >= sizeof(version_)) {
+    memcpy(&version_, data_, sizeof(version_));
+  }
+}
+
+bool HandshakeReader::valid() {
+  return version_ == HANDSHAKE_VERSION;
+}
+
+uint16_t HandshakeReader::version() {
+  return version_;
+}
+
+bool HandshakeReader::get(HandshakeSection type, void* out, uint32_t size) {
+  // the transport may pad the data with zeros, a zero type ends it
+  for (uint32_t pos = sizeof(version_); pos + sizeof(SectionHeader) <= len_;) {
+    SectionHeader header;
+    memcpy(&header, data_ + pos, sizeof(header));
+    pos += sizeof(header);
+    if (header.type_ == 0 || pos + header.len_ > len_) {
+      break;
+    }
+    if (header.type_ == type) {
+      memcpy(out, data_ + pos, std::min<uint32_t>(size, header.len_));
+      return true;
+    }
+    pos += header.len_;
+  }
+  return false;
+}
@@ -0,0 +1,229 @@
+#include <kv_table.h>
+#include <util.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <atomic>
+#include <mutex>
+#include <iterator>
+#include <algorithm>
+
+KVTable::KVTable(uint32_t n_bucket)
+    : n_bucket_(n_bucket),
+      size_(static_cast<size_t>(n_bucket) * KV_BUCKET_SIZE) {
+  // page aligned, so the whole table can be registered as one mr
+  size_t alloc_size = (size_ + 4095) / 4096 * 4096;
+  entries_ = static_cast<KVEntry*>(aligned_alloc(4096, alloc_size));
+  checkNotEqual(entries_, static_cast<KVEntry*>(nullptr), "aligned_alloc() failed to alloc kv table");
+  memset(entries_, 0, alloc_size);
+  info("create kv table, %u buckets, size is %zu", n_bucket_, size_);
+}
+
+KVTable::~KVTable() {
+  free(entries_);
+}
+
+ibv_mr* KVTable::registerMR(Device* device) {
+  // clients only read the table, all writes are done by the server cpu
+  return device->registerMemory(entries_, size_, IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ);
+}
+
+void KVTable::deregisterMR(Device* device) {
+  device->deregisterMemory(entries_);
+}
+
+void* KVTable::addr() {
+  return entries_;
+}
+
+size_t KVTable::size() {
+  return size_;
+}
+
+KVLayout KVTable::layout(uint32_t rkey) {
+  KVLayout layout;
+  layout.addr_ = reinterpret_cast<uint64_t>(entries_);
+  layout.rkey_ = rkey;
+  layout.bucket_num_ = n_bucket_;
+  layout.bucket_ways_ = KV_BUCKET_WAYS;
+  return layout;
+}
+
+// FNV-1a, the seed makes the two bucket choices independent
+uint32_t KVTable::bucketOf(const char* key, uint32_t key_len, uint32_t n_bucket, uint32_t choice) {
+  uint64_t h = 14695981039346656037ULL ^ (0x9e3779b97f4a7c15ULL * (choice + 1));
+  for (uint32_t i = 0; i < key_len; i++) {
+    h ^= static_cast<uint8_t>(key[i]);
+    h *= 1099511628211ULL;
+  }
+  h ^= h >> 33;
+  return static_cast<uint32_t>(h % n_bucket);
+}
+
+uint32_t KVTable::checksum(const KVEntry* entry, uint64_t version) {
+  uint32_t h = 2166136261U;
+  auto mix = [&h](const void* data, size_t len) {
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+    for (size_t i = 0; i < len; i++) {
+      h ^= p[i];
+      h *= 16777619U;
+    }
+  };
+  mix(&version, sizeof(version));
+  mix(&entry->key_len_, sizeof(KVEntry) - offsetof(KVEntry, key_len_));
+  return h;
+}
+
+bool KVTable::isStable(const KVEntry* entry) {
+  if (entry->version_ == 0) {
+    return true;  // never written
+  }
+  return entry->version_ % 2 == 0 && entry->checksum_ == checksum(entry, entry->version_);
+}
+
+KVEntry* KVTable::bucket(uint32_t idx) {
+  return entries_ + static_cast<size_t>(idx) * KV_BUCKET_WAYS;
+}
+
+KVEntry* KVTable::find(const char* key, uint32_t key_len) {
+  if (key_len == 0) {
+    return nullptr;
+  }
+  for (uint32_t choice = 0; choice < 2; choice++) {
+    KVEntry* b = bucket(bucketOf(key, key_len, n_bucket_, choice));
+    for (uint32_t i = 0; i < KV_BUCKET_WAYS; i++) {
+      if (b[i].key_len_ == key_len && memcmp(b[i].key_, key, key_len) == 0) {
+        return &b[i];
+      }
+    }
+  }
+  return nullptr;
+}
+
+void KVTable::write(KVEntry* entry, const char* key, uint32_t key_len, const char* value, uint32_t value_len) {
+  uint64_t version = entry->version_;
+  // odd version, readers will treat the entry as a conflict
+  __atomic_store_n(&entry->version_, version + 1, __ATOMIC_RELEASE);
+  std::atomic_thread_fence(std::memory_order_release);
+
+  memset(entry->key_, 0, KV_KEY_SIZE);
+  memset(entry->value_, 0, KV_VALUE_SIZE);
+  entry->key_len_ = static_cast<uint8_t>(key_len);
+  entry->value_len_ = static_cast<uint8_t>(value_len);
+  // erase writes an empty entry from nullptr
+  if (key_len != 0) {
+    memcpy(entry->key_, key, key_len);
+  }
+  if (value_len != 0) {
+    memcpy(entry->value_, value, value_len);
+  }
+  entry->checksum_ = checksum(entry, version + 2);
+
+  std::atomic_thread_fence(std::memory_order_release);
+  __atomic_store_n(&entry->version_, version + 2, __ATOMIC_RELEASE);
+}
+
+bool KVTable::put(const char* key, uint32_t key_len, const char* value, uint32_t value_len) {
+  if (key_len == 0) {
+    return false;
+  }
+  std::lock_guard<Spinlock> lock(lock_);
+  std::string k(key, key_len);
+  KVEntry* entry = find(key, key_len);
+  bool fit = key_len <= KV_KEY_SIZE && value_len <= KV_VALUE_SIZE;
+  if (fit && entry == nullptr) {
+    for (uint32_t choice = 0; choice < 2 && entry == nullptr; choice++) {
+      KVEntry* b = bucket(bucketOf(key, key_len, n_bucket_, choice));
+      for (uint32_t i = 0; i < KV_BUCKET_WAYS; i++) {
+        if (b[i].key_len_ == 0) {
+          entry = &b[i];
+          break;
+        }
+      }
+    }
+  }
+
+  if (fit && entry != nullptr) {
+    write(entry, key, key_len, value, value_len);
+    overflow_.erase(k);
+    return true;
+  }
+  // too large or both buckets are full, only visible to the rpc path
+  if (entry != nullptr) {
+    write(entry, nullptr, 0, nullptr, 0);
+  }
+  overflow_[k] = std::string(value, value_len);
+  return false;
+}
+
+bool KVTable::get(const char* key, uint32_t key_len, std::string* value) {
+  std::lock_guard<Spinlock> lock(lock_);
+  KVEntry* entry = find(key, key_len);
+  if (entry != nullptr) {
+    value->assign(entry->value_, entry->value_len_);
+    return true;
+  }
+  auto it = overflow_.find(std::string(key, key_len));
+  if (it != overflow_.end()) {
+    *value = it->second;
+    return true;
+  }
+  return false;
+}
+
+bool KVTable::get(const char* key, uint32_t key_len, char* value, uint32_t capacity, uint32_t* value_len) {
+  std::lock_guard<Spinlock> lock(lock_);
+  KVEntry* entry = find(key, key_len);
+  if (entry != nullptr) {
+    *value_len = std::min<uint32_t>(entry->value_len_, capacity);
+    memcpy(value, entry->value_, *value_len);
+    return true;
+  }
+  auto it = overflow_.find(std::string(key, key_len));
+  if (it != overflow_.end()) {
+    *value_len = std::min<uint32_t>(it->second.size(), capacity);
+    memcpy(value, it->second.data(), *value_len);
+    return true;
+  }
+  return false;
+}
+
+// the slots of the table first, then the overflow map
+bool KVTable::scan(KVCursor* cursor, std::string* key, std::string* value) {
+  std::lock_guard<Spinlock> lock(lock_);
+  if (not cursor->started_) {
+    cursor->started_ = true;
+    cursor->overflow_keys_.reserve(overflow_.size());
+    for (auto& it : overflow_) {
+      cursor->overflow_keys_.push_back(it.first);
+    }
+  }
+  uint64_t n_slot = static_cast<uint64_t>(n_bucket_) * KV_BUCKET_WAYS;
+  for (; cursor->slot_ < n_slot; cursor->slot_++) {
+    KVEntry* entry = &entries_[cursor->slot_];
+    if (entry->key_len_ != 0) {
+      key->assign(entry->key_, entry->key_len_);
+      value->assign(entry->value_, entry->value_len_);
+      cursor->slot_++;
+      return true;
+    }
+  }
+  while (cursor->next_overflow_ < cursor->overflow_keys_.size()) {
+    auto it = overflow_.find(cursor->overflow_keys_[cursor->next_overflow_++]);
+    if (it != overflow_.end()) {
+      *key = it->first;
+      *value = it->second;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool KVTable::erase(const char* key, uint32_t key_len) {
+  std::lock_guard<Spinlock> lock(lock_);
+  KVEntry* entry = find(key, key_len);
+  if (entry != nullptr) {
+    write(entry, nullptr, 0, nullptr, 0);
+  }
+  return overflow_.erase(std::string(key, key_len)) > 0 || entry != nullptr;
+}
@@ -1,10 +1,11 @@
 #include <message.h>
 #include <string.h>
 
-Message::Message(char* buf, uint32_t len, MessageType type) {
+Message::Message(char* buf, uint32_t len, MessageType type, Method method) {
   memcpy(meta_.buf_, buf, len); 
   header_.data_len_ = len;
   header_.type_ = type;
+  header_.method_ = method;
 };
 
 Message::~Message() {
@@ -23,4 +24,52 @@ MessageType Message::msgType() {
   return header_.type_;
 }
 
+Method Message::method() {
+  return header_.method_;
+}
+
+uint32_t Message::reqId() {
+  return header_.req_id_;
+}
+
+bool Message::traced() {
+  return (header_.flags_ & MSG_FLAG_TRACED) != 0;
+}
+
+void Message::setTrace(uint32_t req_id, bool traced) {
+  header_.req_id_ = req_id;
+  header_.flags_ = traced ? (header_.flags_ | MSG_FLAG_TRACED) : (header_.flags_ & ~MSG_FLAG_TRACED);
+}
+
+uint32_t Message::slot() {
+  return header_.slot_;
+}
+
+void Message::setSlot(uint32_t slot) {
+  header_.slot_ = slot;
+}
 
+uint32_t Message::budgetUs() {
+  return header_.budget_us_;
+}
+
+void Message::setBudgetUs(uint32_t budget_us) {
+  header_.budget_us_ = budget_us;
+}
+
+bool Message::compactable() {
+  return not traced() && header_.budget_us_ == 0 && header_.data_len_ <= MESSAGE_BUF_SIZE &&
+         header_.type_ < 256 && header_.method_ < 256 && header_.slot_ < 256;
+}
+
+uint32_t Message::compactImm() {
+  return IMM_COMPACT | header_.type_ | header_.method_ << 8 | header_.slot_ << 16;
+}
+
+void Message::fromCompact(uint32_t imm, uint32_t len) {
+  header_ = Header{};
+  header_.data_len_ = len;
+  header_.type_ = static_cast<MessageType>(imm & 0xff);
+  header_.method_ = static_cast<Method>((imm >> 8) & 0xff);
+  header_.slot_ = (imm >> 16) & 0xff;
+}
@@ -0,0 +1,187 @@
+#include <placement.h>
+#include <util.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+// from numaif.h, we call the syscalls directly to avoid depending on libnuma
+#define MPOL_DEFAULT 0
+#define MPOL_PREFERRED 1
+#define MPOL_F_NODE (1 << 0)
+#define MPOL_F_ADDR (1 << 1)
+#define MPOL_MF_MOVE (1 << 1)
+
+constexpr unsigned long MAX_NUMA_NODE = 1024;
+constexpr unsigned long MASK_WORD_BITS = 8 * sizeof(unsigned long);
+
+// false if node doesn't fit in a mask of MAX_NUMA_NODE bits
+static bool nodeMask(int node, unsigned long* mask) {
+  if (node < 0 || static_cast<unsigned long>(node) >= MAX_NUMA_NODE) {
+    return false;
+  }
+  mask[node / MASK_WORD_BITS] |= 1UL << (node % MASK_WORD_BITS);
+  return true;
+}
+
+/* Placement */
+int Placement::deviceNode(ibv_context* verbs) {
+  if (verbs == nullptr) {
+    return -1;
+  }
+  std::ifstream file(std::string(verbs->device->ibdev_path) + "/device/numa_node");
+  int node = -1;
+  if (not (file >> node)) {
+    return -1;
+  }
+  return node;
+}
+
+// parse the cpulist of the node, like "0-7,16-23"
+std::vector<int> Placement::nodeCores(int node) {
+  std::vector<int> cores;
+  if (node < 0) {
+    return cores;
+  }
+  std::ifstream file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+  std::string list;
+  if (not std::getline(file, list)) {
+    return cores;
+  }
+  std::stringstream ss(list);
+  std::string range;
+  while (std::getline(ss, range, ',')) {
+    size_t dash = range.find('-');
+    int first = std::stoi(range.substr(0, dash));
+    int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+    for (int core = first; core <= last; core++) {
+      cores.push_back(core);
+    }
+  }
+  return cores;
+}
+
+bool Placement::bindDevice(ibv_context* verbs) {
+  if (node_.load(std::memory_order_acquire) >= 0) {
+    return false;
+  }
+  int node = deviceNode(verbs);
+  if (node < 0 || static_cast<unsigned long>(node) >= MAX_NUMA_NODE) {
+    return false;
+  }
+  node_.store(node, std::memory_order_release);
+  info("placement: rdma device is on numa node %d", node);
+  return true;
+}
+
+void Placement::setCores(std::vector<int> cores) {
+  cores_ = std::move(cores);
+}
+
+int Placement::node() {
+  return node_.load(std::memory_order_acquire);
+}
+
+void Placement::bindThread(const char* name) {
+  int node = this->node();
+  std::vector<int> cores = cores_.empty() ? nodeCores(node) : cores_;
+  if (not cores.empty()) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int core : cores) {
+      CPU_SET(core, &set);
+    }
+    int ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    wCheckEqual(ret, 0, "pthread_setaffinity_np() failed to pin the thread");
+  }
+  if (node < 0) {
+    return;
+  }
+
+  unsigned long mask[MAX_NUMA_NODE / MASK_WORD_BITS] = {0};
+  if (not nodeMask(node, mask)) {
+    return;
+  }
+  long ret = syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask, MAX_NUMA_NODE);
+  wCheckEqual(ret, 0L, "set_mempolicy() failed to prefer the nic node");
+
+  unsigned cpu = 0, cur = 0;
+  ret = syscall(SYS_getcpu, &cpu, &cur, nullptr);
+  if (ret == 0) {
+    record(cur, name);
+  }
+}
+
+void Placement::moveMemory(void* addr, size_t len) {
+  int node = this->node();
+  if (node < 0 || len == 0) {
+    return;
+  }
+  long page = sysconf(_SC_PAGESIZE);
+  uintptr_t begin = reinterpret_cast<uintptr_t>(addr) / page * page;
+  uintptr_t end = reinterpret_cast<uintptr_t>(addr) + len;
+  unsigned long mask[MAX_NUMA_NODE / MASK_WORD_BITS] = {0};
+  if (not nodeMask(node, mask)) {
+    return;
+  }
+  long ret = syscall(SYS_mbind, begin, end - begin, MPOL_PREFERRED, mask, MAX_NUMA_NODE, MPOL_MF_MOVE);
+  wCheckEqual(ret, 0L, "mbind() failed to move memory to the nic node");
+}
+
+void Placement::checkMemory(const void* addr, const char* name) {
+  if (node() < 0) {
+    return;
+  }
+  int cur = -1;
+  long ret = syscall(SYS_get_mempolicy, &cur, nullptr, 0, addr, MPOL_F_NODE | MPOL_F_ADDR);
+  if (ret == 0) {
+    record(cur, name);
+  }
+}
+
+void Placement::record(int node, const char* name) {
+  if (node == this->node()) {
+    local_num_.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  remote_num_.fetch_add(1, std::memory_order_relaxed);
+  info("placement: %s is on numa node %d, but the rdma device is on node %d", name, node, this->node());
+}
+
+PlacementStats Placement::stats() {
+  PlacementStats stats;
+  stats.nic_node_ = node();
+  stats.local_num_ = local_num_.load(std::memory_order_relaxed);
+  stats.remote_num_ = remote_num_.load(std::memory_order_relaxed);
+  return stats;
+}
+
+
+/* NodeScope */
+NodeScope::NodeScope(int node) {
+  if (node < 0) {
+    return;
+  }
+  long ret = syscall(SYS_get_mempolicy, &mode_, mask_, sizeof(mask_) * 8, nullptr, 0);
+  if (ret != 0) {
+    return;
+  }
+  unsigned long mask[MAX_NUMA_NODE / MASK_WORD_BITS] = {0};
+  if (not nodeMask(node, mask)) {
+    return;
+  }
+  ret = syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask, MAX_NUMA_NODE);
+  wCheckEqual(ret, 0L, "set_mempolicy() failed to prefer the nic node");
+  active_ = ret == 0;
+}
+
+NodeScope::~NodeScope() {
+  if (not active_) {
+    return;
+  }
+  long ret = syscall(SYS_set_mempolicy, mode_, mode_ == MPOL_DEFAULT ? nullptr : mask_, sizeof(mask_) * 8);
+  wCheckEqual(ret, 0L, "set_mempolicy() failed to restore the memory policy");
+}
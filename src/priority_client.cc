@@ -0,0 +1,46 @@
+#include <priority_client.h>
+#include <util.h>
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+/* PriorityClient */
+PriorityClient::PriorityClient() {
+  for (uint32_t priority = 0; priority < PRIORITY_CLASS_NUM; priority++) {
+    clients_[priority].reset(new Client());
+    clients_[priority]->params()->priority_ = priority;
+  }
+}
+
+void PriorityClient::connect(const char* host, const char* port, int timeout_ms) {
+  std::vector<Client*> pending;
+  for (auto& client : clients_) {
+    client->connectAsync(host, port);
+    pending.push_back(client.get());
+  }
+  int n = Client::waitConnected(pending, timeout_ms);
+  checkEqual(n, static_cast<int>(PRIORITY_CLASS_NUM), "fail to connect all priority classes");
+  for (uint32_t priority = 0; priority < PRIORITY_CLASS_NUM; priority++) {
+    wCheckEqual(clients_[priority]->agreed().priority_, priority, "the server granted another priority class");
+  }
+}
+
+Client* PriorityClient::at(uint32_t priority) {
+  return clients_[std::min(priority, PRIORITY_CLASS_NUM - 1)].get();
+}
+
+Message PriorityClient::call(uint32_t priority, Method method, const char* data, uint32_t len) {
+  Message resp;
+  Client* client = at(priority);
+  if (len > client->agreed().max_msg_size_) {
+    return resp;
+  }
+  int id = -1;
+  while ((id = client->callAsync(method, data, len, &resp)) < 0) {
+    std::this_thread::yield();  // all calls of the class are in flight
+  }
+  while (not client->done(id)) {
+    std::this_thread::yield();
+  }
+  return resp;
+}
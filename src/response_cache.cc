@@ -0,0 +1,182 @@
+#include <response_cache.h>
+#include <string.h>
+#include <algorithm>
+#include <mutex>
+
+/* ResponseCache */
+ResponseCache::ResponseCache(uint32_t n_entry)
+    : n_set_(std::max(1U, n_entry / CACHE_WAYS)) {
+  for (auto& ttl : ttl_ns_) {
+    ttl.store(0, std::memory_order_relaxed);
+  }
+}
+
+bool ResponseCache::enable(Method method, uint32_t ttl_us) {
+  if (method >= CACHE_METHOD_NUM || ttl_us == 0) {
+    return false;
+  }
+  std::lock_guard<Spinlock> lock(enable_lock_);
+  // allocated once, lookups only touch it after seeing a ttl
+  if (entries_.empty()) {
+    entries_.resize(static_cast<size_t>(n_set_) * CACHE_WAYS);
+    hands_.resize(n_set_);
+  }
+  if (ttl_ns_[method].exchange(ttl_us * 1000ULL, std::memory_order_release) == 0) {
+    enabled_num_.fetch_add(1, std::memory_order_relaxed);
+  }
+  return true;
+}
+
+void ResponseCache::disable(Method method) {
+  if (method >= CACHE_METHOD_NUM) {
+    return;
+  }
+  std::lock_guard<Spinlock> lock(enable_lock_);
+  if (ttl_ns_[method].exchange(0, std::memory_order_release) != 0) {
+    enabled_num_.fetch_sub(1, std::memory_order_relaxed);
+    drop(method);
+  }
+}
+
+bool ResponseCache::enabled(Method method) {
+  return method < CACHE_METHOD_NUM && ttl_ns_[method].load(std::memory_order_acquire) != 0;
+}
+
+bool ResponseCache::active() {
+  return enabled_num_.load(std::memory_order_relaxed) != 0;
+}
+
+bool ResponseCache::lookup(Message* req, Message* resp, uint64_t now_ns) {
+  if (not enabled(req->method())) {
+    return false;
+  }
+  uint64_t h = hash(req->method(), req->dataAddr(), req->dataLen());
+  uint32_t set = h % n_set_;
+  std::lock_guard<Spinlock> lock(lockOf(set));
+  CacheEntry* entry = find(&entries_[static_cast<size_t>(set) * CACHE_WAYS], h, req);
+  if (entry != nullptr && entry->expire_ns_ <= now_ns) {
+    entry->expire_ns_ = 0;
+    expired_.fetch_add(1, std::memory_order_relaxed);
+    entry = nullptr;
+  }
+  if (entry == nullptr) {
+    misses_.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+  entry->referenced_ = true;
+  *resp = entry->resp_;
+  hits_.fetch_add(1, std::memory_order_relaxed);
+  return true;
+}
+
+void ResponseCache::insert(Message* req, const Message& resp, uint64_t now_ns) {
+  uint64_t ttl_ns = req->method() < CACHE_METHOD_NUM ? ttl_ns_[req->method()].load(std::memory_order_acquire) : 0;
+  if (ttl_ns == 0 || req->dataLen() > MESSAGE_BUF_SIZE) {
+    return;
+  }
+  uint64_t h = hash(req->method(), req->dataAddr(), req->dataLen());
+  uint32_t set = h % n_set_;
+  std::lock_guard<Spinlock> lock(lockOf(set));
+  CacheEntry* ways = &entries_[static_cast<size_t>(set) * CACHE_WAYS];
+  CacheEntry* victim = find(ways, h, req);
+  // an empty or expired way, else the first way the hand finds unreferenced
+  for (uint32_t i = 0; victim == nullptr && i < CACHE_WAYS; i++) {
+    if (ways[i].expire_ns_ <= now_ns) {
+      victim = &ways[i];
+    }
+  }
+  uint8_t& hand = hands_[set];
+  while (victim == nullptr) {
+    CacheEntry* entry = &ways[hand];
+    hand = (hand + 1) % CACHE_WAYS;
+    if (entry->referenced_) {
+      entry->referenced_ = false;
+      continue;
+    }
+    victim = entry;
+    evictions_.fetch_add(1, std::memory_order_relaxed);
+  }
+  victim->hash_ = h;
+  victim->expire_ns_ = now_ns + ttl_ns;
+  victim->method_ = req->method();
+  victim->req_len_ = req->dataLen();
+  victim->referenced_ = false;
+  memcpy(victim->req_, req->dataAddr(), req->dataLen());
+  victim->resp_ = resp;
+  inserts_.fetch_add(1, std::memory_order_relaxed);
+}
+
+void ResponseCache::clear() {
+  std::lock_guard<Spinlock> lock(enable_lock_);
+  for (uint32_t set = 0; set < hands_.size(); set++) {
+    std::lock_guard<Spinlock> set_lock(lockOf(set));
+    for (uint32_t i = 0; i < CACHE_WAYS; i++) {
+      entries_[static_cast<size_t>(set) * CACHE_WAYS + i].expire_ns_ = 0;
+    }
+  }
+}
+
+CacheStats ResponseCache::stats() {
+  CacheStats stats;
+  stats.hits_ = hits_.load(std::memory_order_relaxed);
+  stats.misses_ = misses_.load(std::memory_order_relaxed);
+  stats.inserts_ = inserts_.load(std::memory_order_relaxed);
+  stats.evictions_ = evictions_.load(std::memory_order_relaxed);
+  stats.expired_ = expired_.load(std::memory_order_relaxed);
+  return stats;
+}
+
+double ResponseCache::hitRate() {
+  uint64_t hits = hits_.load(std::memory_order_relaxed);
+  uint64_t lookups = hits + misses_.load(std::memory_order_relaxed);
+  return lookups == 0 ? 0.0 : static_cast<double>(hits) / lookups;
+}
+
+// 8 bytes per step, the payload is at most MESSAGE_BUF_SIZE
+uint64_t ResponseCache::hash(Method method, const char* data, uint32_t len) {
+  uint64_t h = 0x9e3779b97f4a7c15ULL ^ (static_cast<uint64_t>(method) << 32 | len);
+  uint32_t i = 0;
+  for (; i + 8 <= len; i += 8) {
+    uint64_t word;
+    memcpy(&word, data + i, sizeof(word));
+    h = (h ^ word) * 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 29;
+  }
+  if (i < len) {
+    uint64_t word = 0;
+    memcpy(&word, data + i, len - i);
+    h = (h ^ word) * 0xbf58476d1ce4e5b9ULL;
+  }
+  h ^= h >> 32;
+  h *= 0x94d049bb133111ebULL;
+  h ^= h >> 29;
+  return h;
+}
+
+CacheEntry* ResponseCache::find(CacheEntry* set, uint64_t h, Message* req) {
+  for (uint32_t i = 0; i < CACHE_WAYS; i++) {
+    CacheEntry* entry = &set[i];
+    if (entry->expire_ns_ != 0 && entry->hash_ == h && entry->method_ == req->method() &&
+        entry->req_len_ == req->dataLen() && memcmp(entry->req_, req->dataAddr(), req->dataLen()) == 0) {
+      return entry;
+    }
+  }
+  return nullptr;
+}
+
+Spinlock& ResponseCache::lockOf(uint32_t set) {
+  return locks_[set % CACHE_LOCK_NUM];
+}
+
+// enable_lock_ must be held
+void ResponseCache::drop(Method method) {
+  for (uint32_t set = 0; set < hands_.size(); set++) {
+    std::lock_guard<Spinlock> set_lock(lockOf(set));
+    for (uint32_t i = 0; i < CACHE_WAYS; i++) {
+      CacheEntry* entry = &entries_[static_cast<size_t>(set) * CACHE_WAYS + i];
+      if (entry->method_ == method) {
+        entry->expire_ns_ = 0;
+      }
+    }
+  }
+}
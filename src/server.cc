@@ -3,6 +3,12 @@
 #include <const.h>
 #include <iostream>
 #include <mutex>
+#include <context.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <algorithm>
+#include <chrono>
+#include <trace.h>
 
 Server::Server(const char* host, const char* port) {
 
@@ -22,6 +28,21 @@ Server::Server(const char* host, const char* port) {
   ret = rdma_bind_addr(listen_cm_id_, addr_->ai_addr);
   checkEqual(ret, 0 ,"rdma_bind_addr() failed");
 
+  // verbs is only known here when binding to the address of a device
+  if (placement_.bindDevice(listen_cm_id_->verbs)) {
+    placement_.moveMemory(kv_table_.addr(), kv_table_.size());
+    placement_.checkMemory(kv_table_.addr(), "kv table");
+    placement_.moveMemory(atomics_.addr(), atomics_.size());
+  }
+  if (listen_cm_id_->verbs != nullptr) {
+    // build connection resources before the first client arrives
+    Device* device = Device::get(listen_cm_id_->verbs);
+    kv_table_.registerMR(device);
+    atomics_.registerMR(device);
+    devices_.insert(device);
+    prewarm(device);
+  }
+
   // Now we start to listen on the passed IP and port. However unlike
 	// normal TCP listen, this is a non-blocking call. When a new client is 
 	// connected, a new connection management (CM) event is generated on the 
@@ -33,15 +54,28 @@ Server::Server(const char* host, const char* port) {
 
   // Now, register a conn_event
   // In order to avoid block
+  int flags = fcntl(cm_event_channel_->fd, F_GETFL);
+  ret = fcntl(cm_event_channel_->fd, F_SETFL, flags | O_NONBLOCK);
+  checkEqual(ret, 0, "fcntl() failed to set the cm event channel non-blocking");
   base_ = event_base_new();
   checkNotEqual(base_, static_cast<event_base*>(nullptr), "event_base_new() failed");
   conn_event_ = event_new(base_, cm_event_channel_->fd, EV_READ | EV_PERSIST, &Server::onConnectionEvent, this); // bind the event to channel fd
   checkNotEqual(conn_event_, static_cast<event*>(nullptr), "event_new() failed to create conn_event");
   ret = event_add(conn_event_, nullptr); // register the event
   checkEqual(ret, 0, "event_add() failed to register conn_event");
+
+  poller_.handler()->setKVTable(&kv_table_);
+  poller_.setCache(&cache_);
 }
 
 Server::~Server() {
+  poller_.stop();
+  for (auto device : devices_) {
+    kv_table_.deregisterMR(device);
+    atomics_.deregisterMR(device);
+  }
+  PlacementStats stats = placement_.stats();
+  info("placement: nic node %d, %u local, %u remote", stats.nic_node_, stats.local_num_, stats.remote_num_);
   event_base_free(base_);
   event_free(conn_event_);
   event_free(exit_event_);
@@ -58,20 +92,30 @@ void Server::onConnectionEvent([[gnu::unused]]evutil_socket_t fd, [[gnu::unused]
 
 void Server::handleConnectionEvent() {
   rdma_cm_event* cm_ev;
-  // wait the client connect, blocking
-  // But! must get value immediately because conn_event, so it's like non-blocking
-  int ret = rdma_get_cm_event(cm_event_channel_, &cm_ev);
-  checkEqual(ret, 0, "rdma_get_cm_event() failed");
+  // the channel is non-blocking, take every event arrived, so that
+  // a reconnect storm is accepted in one callback
+  while (rdma_get_cm_event(cm_event_channel_, &cm_ev) == 0) {
+    handleCMEvent(cm_ev);
+  }
+  checkEqual(errno, EAGAIN, "rdma_get_cm_event() failed");
 
+  // refill the pools off the accept path
+  for (auto device : devices_) {
+    prewarm(device);
+  }
+}
+
+void Server::handleCMEvent(rdma_cm_event* cm_ev) {
   if (cm_ev->status != 0) {
     info("got a bad cm_event");
+    rdma_ack_cm_event(cm_ev);
     return;
   }
 
   switch(cm_ev->event) {
     case RDMA_CM_EVENT_CONNECT_REQUEST: {
       info("start to handle a connection request");
-      setupConnection(cm_ev, 64);
+      setupConnection(cm_ev);
       break;
     }
     case RDMA_CM_EVENT_ESTABLISHED: {
@@ -91,32 +135,59 @@ void Server::handleConnectionEvent() {
     }
     default: {
       info("unexpected event: %s", rdma_event_str(cm_ev->event));
+      rdma_ack_cm_event(cm_ev);
       break;
     }
   }
+}
 
+void Server::prewarm(Device* device) {
+  // sized for clients asking for the defaults
+  ConnParams params = ConnParams().negotiate(params_);
+  device->reserve(PREWARM_CONNECTION_NUM, Connection::cqeNum(params), true,
+                  Connection::bufferSize(Role::ServerConn, params));
 }
 
 
 void Server::run() {
   // run poller
-  poller_.run();
+  poller_.run(&placement_);
   // listen connection
   info("start event loop for conection");
   info("==============================");
   event_base_dispatch(base_);
 }
 
-void Server::setupConnection(rdma_cm_event* cm_event, uint32_t n_buffer_page) {
+void Server::setupConnection(rdma_cm_event* cm_event) {
 
   rdma_cm_id* client_id = cm_event->id;
-  Connection* conn = new Connection(Role::ServerConn, client_id, n_buffer_page);
+  if (placement_.bindDevice(client_id->verbs)) {
+    // listening on any address, the device is known from the first client
+    placement_.moveMemory(kv_table_.addr(), kv_table_.size());
+    placement_.checkMemory(kv_table_.addr(), "kv table");
+    placement_.moveMemory(atomics_.addr(), atomics_.size());
+  }
+  HandshakeReader reader(cm_event->param.conn.private_data, cm_event->param.conn.private_data_len);
+  if (not reader.valid()) {
+    info("client speaks handshake version %u, expected %u, reject", reader.version(), HANDSHAKE_VERSION);
+    int ret = rdma_reject(client_id, nullptr, 0);
+    wCheckEqual(ret, 0, "rdma_reject() failed");
+    ret = rdma_ack_cm_event(cm_event);
+    wCheckEqual(ret, 0, "rdma_ack_cm_event() failed to ack event");
+    rdma_destroy_id(client_id);
+    return;
+  }
+  ConnParams asked;
+  reader.get(SectionParams, &asked, sizeof(asked));
+  ConnParams agreed = params_.negotiate(asked);
+  info("client asks for %u recv slots of %u messages, agree on %u of %u",
+       asked.recv_slot_num_, asked.frame_msg_num_, agreed.recv_slot_num_, agreed.frame_msg_num_);
+  Connection* conn = new Connection(Role::ServerConn, client_id, agreed, &kv_table_, &placement_, &atomics_);
+  devices_.insert(Device::get(client_id->verbs));
   rdma_conn_param param = conn->copyConnParam();
   int ret = rdma_accept(client_id, &param);
   checkEqual(ret, 0, "rdma_accept() failed");
-  uint32_t rkey = *(uint32_t*)(cm_event->param.conn.private_data);
-  conn->setRkey(rkey);
-  
+
   ret = rdma_ack_cm_event(cm_event);
   wCheckEqual(ret, 0, "rdma_ack_cm_event() failed to ack event");
   info("accept the connection");
@@ -126,34 +197,147 @@ void Server::setupConnection(rdma_cm_event* cm_event, uint32_t n_buffer_page) {
   client_id->context = reinterpret_cast<void*>(conn); // in order to release when client disconnect
 }
 
+KVTable* Server::kvTable() {
+  return &kv_table_;
+}
+
+AtomicRegion* Server::atomics() {
+  return &atomics_;
+}
+
+void Server::setHandler(Handler* handler) {
+  poller_.setHandler(handler);
+  poller_.handler()->setKVTable(&kv_table_);
+}
+
+ResponseCache* Server::cache() {
+  return &cache_;
+}
+
+Placement* Server::placement() {
+  return &placement_;
+}
+
+ConnParams* Server::params() {
+  return &params_;
+}
+
+void Server::setWeight(uint32_t priority, uint32_t weight) {
+  poller_.setWeight(priority, weight);
+}
+
+uint64_t Server::expiredNum() {
+  return poller_.expiredNum();
+}
+
+
+/* ConnTable */
+Connection* ConnTable::find(uint32_t qp_num) {
+  auto it = std::lower_bound(qp_nums_.begin(), qp_nums_.end(), qp_num);
+  if (it == qp_nums_.end() || *it != qp_num) {
+    return nullptr;
+  }
+  return conns_[it - qp_nums_.begin()];
+}
+
 
 /* ServerPoller */
 ServerPoller::ServerPoller() {
-
+  table_.store(new ConnTable(), std::memory_order_release);
+  std::copy(PRIORITY_WEIGHTS, PRIORITY_WEIGHTS + PRIORITY_CLASS_NUM, weights_);
 }
 
 ServerPoller::~ServerPoller() {
-  std::lock_guard<Spinlock> lock(lock_);
-  conn_list_.clear();
+  stop();
+  delete table_.load(std::memory_order_acquire);
+}
+
+ConnTable* ServerPoller::copyTable() {
+  return new ConnTable(*table_.load(std::memory_order_acquire));
 }
 
 void ServerPoller::registerConn(Connection* conn) {
   std::lock_guard<Spinlock> lock(lock_);
-  conn_list_.emplace_back(conn);
+  ConnTable* table = copyTable();
+  auto it = std::lower_bound(table->qp_nums_.begin(), table->qp_nums_.end(), conn->getQPNum());
+  table->conns_.insert(table->conns_.begin() + (it - table->qp_nums_.begin()), conn);
+  table->qp_nums_.insert(it, conn->getQPNum());
+  if (cq_ref_[conn->getCQ()]++ == 0) {
+    table->cqs_[conn->params().priority_].push_back(conn->getCQ());
+  }
+  publish(table, nullptr);
 }
 
 void ServerPoller::deregisterConn(Connection* conn) {
-  std::lock_guard<Spinlock> lock(lock_);
-  for (auto it = conn_list_.begin(); it != conn_list_.end(); it++) {
-    if ((*it) == conn) {
-      conn_list_.erase(it);
-      delete conn;
-      break;
+  // the flushed work requests come back through the poller while the
+  // connection is still routed, a qp reusing its number finds none left.
+  // A post racing with the flush is counted once the poller starts a new pass.
+  conn->flush();
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(DEFAULT_CONNECTION_TIMEOUT);
+  for (int round = 0; round < 2; round++) {
+    while (running_.load(std::memory_order_acquire) && conn->postedNum() > 0 &&
+           std::chrono::steady_clock::now() < deadline) {
+      std::this_thread::yield();
     }
+    waitPass();
+  }
+  std::lock_guard<Spinlock> lock(lock_);
+  ConnTable* table = copyTable();
+  auto it = std::find(table->conns_.begin(), table->conns_.end(), conn);
+  if (it == table->conns_.end()) {
+    delete table;
+    return;
+  }
+  table->qp_nums_.erase(table->qp_nums_.begin() + (it - table->conns_.begin()));
+  table->conns_.erase(it);
+  if (--cq_ref_[conn->getCQ()] == 0) {
+    cq_ref_.erase(conn->getCQ());
+    auto& cqs = table->cqs_[conn->params().priority_];
+    cqs.erase(std::find(cqs.begin(), cqs.end(), conn->getCQ()));
   }
+  publish(table, conn);
 }
 
-void ServerPoller::run() {
+void ServerPoller::publish(ConnTable* table, Connection* retired) {
+  ConnTable* old = table_.exchange(table, std::memory_order_seq_cst);
+  // the poller can't hold the old table in its new pass
+  waitPass();
+  delete old;
+  delete retired;
+}
+
+void ServerPoller::waitPass() {
+  uint64_t epoch = global_epoch_.fetch_add(1, std::memory_order_seq_cst) + 1;
+  // only this (libevent) thread waits, the poll loop never does
+  while (reader_epoch_.load(std::memory_order_seq_cst) < epoch) {
+    std::this_thread::yield();
+  }
+}
+
+Handler* ServerPoller::handler() {
+  return handler_;
+}
+
+void ServerPoller::setHandler(Handler* handler) {
+  handler_ = handler != nullptr ? handler : &default_handler_;
+}
+
+void ServerPoller::setCache(ResponseCache* cache) {
+  cache_ = cache;
+}
+
+void ServerPoller::setWeight(uint32_t priority, uint32_t weight) {
+  if (priority < PRIORITY_CLASS_NUM) {
+    weights_[priority] = std::max(1U, weight);
+  }
+}
+
+uint64_t ServerPoller::expiredNum() {
+  return expired_num_.load(std::memory_order_relaxed);
+}
+
+void ServerPoller::run(Placement* placement) {
+  placement_ = placement;
   running_.store(true, std::memory_order_release);
   poll_thread_ = std::thread(&ServerPoller::poll, this);
   info("start running server poller");
@@ -167,11 +351,160 @@ void ServerPoller::stop() {
   }
 }
 
+void ServerPoller::traceBatch(TracePoint point) {
+  for (size_t k = 0; k < batch_conn_.size(); k++) {
+    for (size_t i = batch_begin_[k]; i < batch_begin_[k + 1]; i++) {
+      if (batch_req_[i]->traced()) {
+        Tracer::record(point, batch_conn_[k]->getQPNum(), batch_req_[i]->reqId());
+      }
+    }
+  }
+}
+
+void ServerPoller::pumpStreams(ConnTable* table) {
+  // recounted every pass, streams of closed connections just disappear
+  uint32_t active = 0;
+  for (auto conn : table->conns_) {
+    if (conn->streaming() && conn->pumpStream()) {
+      active++;
+    }
+  }
+  stream_num_ = active;
+}
+
+void ServerPoller::handleBatch(uint64_t since_ns) {
+  // unpack the frames, the requests of a connection stay contiguous,
+  // the ones whose caller has given up are answered without the handler
+  uint64_t now_ns = 0;
+  for (auto conn : batch_conn_) {
+    batch_begin_.push_back(batch_req_.size());
+    if (conn->hasDeadlines()) {
+      now_ns = now_ns != 0 ? now_ns : nowNs();
+      expired_num_.fetch_add(conn->dropExpired(now_ns, since_ns), std::memory_order_relaxed);
+    }
+    for (auto req : conn->pendingRequests()) {
+      if (Handler::isStreaming(req->method()) && req->msgType() != OneWay &&
+          (conn->params().modes_ & ModeStream) && not conn->streaming()) {
+        conn->startStream(req, handler_->openStream(req));
+        stream_num_++;
+        continue;
+      }
+      batch_req_.push_back(req);
+    }
+  }
+  batch_begin_.push_back(batch_req_.size());
+
+  batch_resp_.resize(batch_req_.size());
+  // the requests of a batch share its start and end
+  traceBatch(HandlerStart);
+  RequestContext ctx{&arena_};
+  if (cache_ != nullptr && cache_->active()) {
+    handleCached(&ctx);
+  } else {
+    handler_->handlerBatch(batch_req_.data(), batch_resp_.data(), batch_req_.size(), &ctx);
+  }
+  traceBatch(HandlerEnd);
+  for (size_t k = 0; k < batch_conn_.size(); k++) {
+    size_t begin = batch_begin_[k];
+    batch_conn_[k]->respond(batch_req_.data() + begin, batch_resp_.data() + begin, batch_begin_[k + 1] - begin);
+  }
+  info("handle over, batch size is %zu", batch_req_.size());
+  // the responses are copied into the send slots
+  arena_.reset();
+  batch_conn_.clear();
+  batch_begin_.clear();
+  batch_req_.clear();
+}
+
+bool ServerPoller::pollClass(ConnTable* table, uint32_t priority) {
+  uint32_t quota = weights_[priority] * DEFAULT_CQ_CAPACITY;
+  // round robin over the cqs of the class while they have more
+  for (bool more = true; more && quota > 0;) {
+    more = false;
+    for (auto cq : table->cqs_[priority]) {
+      uint32_t asked = std::min(quota, DEFAULT_CQ_CAPACITY);
+      int n = ibv_poll_cq(cq, asked, wc_);
+      if (n < 0) {
+        info("poll cq error");
+        continue;
+      }
+      for (int i = 0; i < n; i++) {
+        Connection* conn = table->find(wc_[i].qp_num);
+        if (conn == nullptr) {
+          // left by a connection already gone
+          delete reinterpret_cast<Context*>(wc_[i].wr_id);
+          continue;
+        }
+        conn->advance(wc_[i]);
+        // a connection joins the batch with its first frame of the pass
+        if (wc_[i].status == IBV_WC_SUCCESS && wc_[i].opcode == IBV_WC_RECV && conn->pendingFrameNum() == 1) {
+          batch_conn_.push_back(conn);
+        }
+      }
+      quota -= n;
+      more = more || static_cast<uint32_t>(n) == asked;
+      if (quota == 0) {
+        break;
+      }
+    }
+    if (not more) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void ServerPoller::handleCached(RequestContext* ctx) {
+  uint64_t now_ns = nowNs();
+  // the hits skip the handler, the misses are a batch of their own
+  for (size_t i = 0; i < batch_req_.size(); i++) {
+    Message* req = batch_req_[i];
+    if (req->msgType() == OneWay || not cache_->lookup(req, &batch_resp_[i], now_ns)) {
+      miss_idx_.push_back(i);
+      miss_req_.push_back(req);
+    }
+  }
+  miss_resp_.resize(miss_req_.size());
+  handler_->handlerBatch(miss_req_.data(), miss_resp_.data(), miss_req_.size(), ctx);
+  for (size_t k = 0; k < miss_idx_.size(); k++) {
+    batch_resp_[miss_idx_[k]] = miss_resp_[k];
+    if (miss_req_[k]->msgType() != OneWay) {
+      cache_->insert(miss_req_[k], miss_resp_[k], now_ns);
+    }
+  }
+  miss_idx_.clear();
+  miss_req_.clear();
+}
+
 void ServerPoller::poll() {
+  int bound_node = INT32_MIN;
+  std::fill(drained_ns_, drained_ns_ + PRIORITY_CLASS_NUM, nowNs());
   while (running_.load(std::memory_order_acquire)) {
-    std::lock_guard<Spinlock> lock(lock_);
-    for (auto conn : conn_list_) {
-      conn->poll();
+    // a wildcard listener learns the nic node with its first client,
+    // the poller is bound again once it is known
+    if (placement_ != nullptr && placement_->node() != bound_node) {
+      bound_node = placement_->node();
+      placement_->bindThread("server poller");
+    }
+    // quiescent point, no table of an earlier pass is referenced any more
+    reader_epoch_.store(global_epoch_.load(std::memory_order_seq_cst), std::memory_order_seq_cst);
+    ConnTable* table = table_.load(std::memory_order_seq_cst);
+    // the urgent classes are answered before the others are even polled,
+    // and a bulk class takes at most its weight of the pass
+    uint64_t pass_ns = nowNs();
+    for (uint32_t priority = 0; priority < PRIORITY_CLASS_NUM; priority++) {
+      bool drained = pollClass(table, priority);
+      if (not batch_conn_.empty()) {
+        handleBatch(drained_ns_[priority]);
+      }
+      // a request left in a cq by the quota may be older than this pass
+      if (drained) {
+        drained_ns_[priority] = pass_ns;
+      }
+    }
+    if (stream_num_ > 0) {
+      pumpStreams(table);
     }
   }
+  reader_epoch_.store(UINT64_MAX, std::memory_order_seq_cst);
 }
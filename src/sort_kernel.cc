@@ -0,0 +1,95 @@
+#include <sort_kernel.h>
+#include <string.h>
+#include <limits>
+#include <assert.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+static_assert(MESSAGE_BUF_SIZE <= 64, "the kernels keep one bit per byte in a uint64_t");
+
+// counting sort over the 256 byte values
+void sortBytesScalar(char* data, uint32_t len) {
+  assert(len <= MESSAGE_BUF_SIZE);
+  // map char to an index that keeps its order, whether char is signed or not
+  constexpr uint8_t flip = std::numeric_limits<char>::is_signed ? 0x80 : 0;
+  uint8_t count[256] = {0};
+  for (uint32_t i = 0; i < len; i++) {
+    count[static_cast<uint8_t>(data[i]) ^ flip]++;
+  }
+  uint32_t pos = 0;
+  for (uint32_t v = 0; v < 256 && pos < len; v++) {
+    for (uint8_t c = count[v]; c > 0; c--) {
+      data[pos++] = static_cast<char>(v ^ flip);
+    }
+  }
+}
+
+#if defined(__x86_64__)
+
+static inline uint64_t validMask(uint32_t len) {
+  return len >= 64 ? ~0ULL : (1ULL << len) - 1;
+}
+
+// char is signed on x86, so the signed epi8 compares give the std::sort order
+void sortBytesSSE(char* data, uint32_t len) {
+  assert(len <= MESSAGE_BUF_SIZE);
+  alignas(64) char in[64] = {0};
+  memcpy(in, data, len);
+  __m128i v[4];
+  for (int k = 0; k < 4; k++) {
+    v[k] = _mm_load_si128(reinterpret_cast<const __m128i*>(in) + k);
+  }
+  uint64_t valid = validMask(len);
+  for (uint32_t i = 0; i < len; i++) {
+    __m128i x = _mm_set1_epi8(in[i]);
+    uint64_t lt = 0, eq = 0;
+    for (int k = 0; k < 4; k++) {
+      lt |= static_cast<uint64_t>(_mm_movemask_epi8(_mm_cmpgt_epi8(x, v[k]))) << (16 * k);
+      eq |= static_cast<uint64_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(x, v[k]))) << (16 * k);
+    }
+    uint32_t rank = __builtin_popcountll(lt & valid) + __builtin_popcountll(eq & ((1ULL << i) - 1));
+    data[rank] = in[i];
+  }
+}
+
+[[gnu::target("avx2,popcnt")]]
+void sortBytesAVX2(char* data, uint32_t len) {
+  assert(len <= MESSAGE_BUF_SIZE);
+  alignas(64) char in[64] = {0};
+  memcpy(in, data, len);
+  __m256i lo = _mm256_load_si256(reinterpret_cast<const __m256i*>(in));
+  __m256i hi = _mm256_load_si256(reinterpret_cast<const __m256i*>(in) + 1);
+  uint64_t valid = validMask(len);
+  for (uint32_t i = 0; i < len; i++) {
+    __m256i x = _mm256_set1_epi8(in[i]);
+    uint64_t lt = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpgt_epi8(x, lo))) |
+                  static_cast<uint64_t>(static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpgt_epi8(x, hi)))) << 32;
+    uint64_t eq = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, lo))) |
+                  static_cast<uint64_t>(static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, hi)))) << 32;
+    uint32_t rank = __builtin_popcountll(lt & valid) + __builtin_popcountll(eq & ((1ULL << i) - 1));
+    data[rank] = in[i];
+  }
+}
+
+bool hasAVX2() {
+  static const bool has = __builtin_cpu_supports("avx2");
+  return has;
+}
+
+void sortBytes(char* data, uint32_t len) {
+  if (hasAVX2()) {
+    sortBytesAVX2(data, len);
+  } else {
+    sortBytesSSE(data, len);
+  }
+}
+
+#else
+
+void sortBytes(char* data, uint32_t len) {
+  sortBytesScalar(data, len);
+}
+
+#endif
@@ -0,0 +1,173 @@
+#include <trace.h>
+#include <misc.h>
+#include <util.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <algorithm>
+#include <array>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+static const char* point_names[] = {
+  "client_post", "client_send_done", "server_recv", "handler_start",
+  "handler_end", "server_resp_post", "client_recv",
+};
+
+// spans drawn between two points of the same request
+static const struct {
+  const char* name_;
+  TracePoint begin_;
+  TracePoint end_;
+} spans[] = {
+  {"rpc", ClientPost, ClientRecv},
+  {"client_send", ClientPost, ClientSendDone},
+  {"server_queue", ServerRecv, HandlerStart},
+  {"handler", HandlerStart, HandlerEnd},
+  {"server", ServerRecv, ServerRespPost},
+};
+
+constexpr double SAMPLE_SCALE = 4294967296.0;  // 2^32
+
+static uint64_t initialThreshold() {
+  const char* env = getenv("RDMA_RPC_TRACE_RATE");
+  if (env == nullptr) {
+    return 0;
+  }
+  double rate = atof(env);
+  rate = rate < 0 ? 0 : (rate > 1 ? 1 : rate);
+  return static_cast<uint64_t>(rate * SAMPLE_SCALE);
+}
+
+// a request is sampled if a 32-bit random number is below it
+static std::atomic_uint64_t sample_threshold{initialThreshold()};
+
+// rings are never freed, so they survive their threads until export
+static Spinlock rings_lock;
+static std::vector<TraceRing*> rings;
+static thread_local TraceRing* local_ring = nullptr;
+
+void Tracer::setSampleRate(double rate) {
+  rate = rate < 0 ? 0 : (rate > 1 ? 1 : rate);
+  sample_threshold.store(static_cast<uint64_t>(rate * SAMPLE_SCALE), std::memory_order_relaxed);
+}
+
+double Tracer::sampleRate() {
+  return sample_threshold.load(std::memory_order_relaxed) / SAMPLE_SCALE;
+}
+
+bool Tracer::sample() {
+  uint64_t threshold = sample_threshold.load(std::memory_order_relaxed);
+  if (threshold == 0) {
+    return false;
+  }
+  // xorshift64, one state per thread
+  thread_local uint64_t x = nowNs() | 1;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  return (x >> 32) < threshold;
+}
+
+uint32_t Tracer::nextReqId() {
+  static std::atomic_uint32_t next_req_id{1};
+  return next_req_id.fetch_add(1, std::memory_order_relaxed);
+}
+
+void Tracer::record(TracePoint point, uint32_t conn_id, uint32_t req_id) {
+  if (local_ring == nullptr) {
+    local_ring = new TraceRing();
+    local_ring->tid_ = static_cast<uint32_t>(syscall(SYS_gettid));
+    std::lock_guard<Spinlock> lock(rings_lock);
+    rings.push_back(local_ring);
+  }
+  // only the owner thread writes, the exporter reads up to head_
+  uint64_t head = local_ring->head_.load(std::memory_order_relaxed);
+  local_ring->writing_.store(head + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  TraceEvent* ev = &local_ring->events_[head % TRACE_RING_SIZE];
+  __atomic_store_n(&ev->ts_ns_, nowNs(), __ATOMIC_RELAXED);
+  __atomic_store_n(&ev->conn_id_, conn_id, __ATOMIC_RELAXED);
+  __atomic_store_n(&ev->req_id_, req_id, __ATOMIC_RELAXED);
+  __atomic_store_n(&ev->point_, point, __ATOMIC_RELAXED);
+  local_ring->head_.store(head + 1, std::memory_order_release);
+}
+
+// the events of ring still intact after they are copied, oldest first
+static std::vector<TraceEvent> snapshotRing(TraceRing* ring) {
+  uint64_t head = ring->head_.load(std::memory_order_acquire);
+  uint64_t begin = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+  std::vector<TraceEvent> events(head - begin);
+  for (uint64_t i = begin; i < head; i++) {
+    TraceEvent* ev = &ring->events_[i % TRACE_RING_SIZE];
+    TraceEvent& copy = events[i - begin];
+    copy.ts_ns_ = __atomic_load_n(&ev->ts_ns_, __ATOMIC_RELAXED);
+    copy.conn_id_ = __atomic_load_n(&ev->conn_id_, __ATOMIC_RELAXED);
+    copy.req_id_ = __atomic_load_n(&ev->req_id_, __ATOMIC_RELAXED);
+    copy.point_ = __atomic_load_n(&ev->point_, __ATOMIC_RELAXED);
+  }
+  // the events up to writing - TRACE_RING_SIZE may have been overwritten meanwhile
+  std::atomic_thread_fence(std::memory_order_acquire);
+  uint64_t writing = ring->writing_.load(std::memory_order_relaxed);
+  uint64_t valid = writing > TRACE_RING_SIZE ? writing - TRACE_RING_SIZE : 0;
+  if (valid > begin) {
+    events.erase(events.begin(), events.begin() + std::min(valid - begin, head - begin));
+  }
+  return events;
+}
+
+bool Tracer::exportChromeTrace(const char* path) {
+  FILE* file = fopen(path, "w");
+  if (file == nullptr) {
+    info("fail to open trace file %s", path);
+    return false;
+  }
+
+  std::vector<TraceRing*> snapshot;
+  {
+    std::lock_guard<Spinlock> lock(rings_lock);
+    snapshot = rings;
+  }
+
+  int pid = getpid();
+  bool first = true;
+  // (conn_id, req_id) -> the first thread and event of every point, the
+  // req_ids of different client processes collide
+  std::unordered_map<uint64_t, std::array<std::pair<uint32_t, TraceEvent>, sizeof(point_names) / sizeof(point_names[0])>> reqs;
+  fprintf(file, "{\"traceEvents\":[\n");
+  for (auto ring : snapshot) {
+    for (const TraceEvent& ev : snapshotRing(ring)) {
+      fprintf(file, "%s{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,\"pid\":%d,\"tid\":%u,"
+              "\"args\":{\"conn\":%u,\"req\":%u}}",
+              first ? "" : ",\n", point_names[ev.point_], ev.ts_ns_ / 1000.0, pid, ring->tid_,
+              ev.conn_id_, ev.req_id_);
+      first = false;
+      auto& points = reqs[static_cast<uint64_t>(ev.conn_id_) << 32 | ev.req_id_];
+      if (points[ev.point_].second.ts_ns_ == 0) {
+        points[ev.point_] = {ring->tid_, ev};
+      }
+    }
+  }
+
+  for (auto& it : reqs) {
+    for (auto& span : spans) {
+      uint32_t tid = it.second[span.begin_].first;
+      const TraceEvent& b = it.second[span.begin_].second;
+      const TraceEvent& e = it.second[span.end_].second;
+      if (b.ts_ns_ == 0 || e.ts_ns_ < b.ts_ns_) {
+        continue;
+      }
+      fprintf(file, "%s{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%u,"
+              "\"args\":{\"conn\":%u,\"req\":%u}}",
+              first ? "" : ",\n", span.name_, b.ts_ns_ / 1000.0, (e.ts_ns_ - b.ts_ns_) / 1000.0, pid, tid,
+              b.conn_id_, b.req_id_);
+      first = false;
+    }
+  }
+  fprintf(file, "\n]}\n");
+  fclose(file);
+  return true;
+}